@@ -0,0 +1,60 @@
+/* Merge-based set algebra against the per-element alternative. Two sets of
+ * `n` random keys drawn from a range of 2n values (so about half overlap) are
+ * combined with each of set_union, set_intersect, set_difference and
+ * set_symdiff, and, for comparison, the difference is also computed by
+ * mapping over one set and looking each element up in the other. Prints the
+ * time of each.
+ *
+ * Build: cc -O2 -D_POSIX_C_SOURCE=200809L -I.. algebra.c ../set.c -pthread -o algebra
+ * Usage: ./algebra [n] [order]
+ */
+#include "../set.h"
+#include "bench.h"
+#include <stdlib.h>
+
+typedef struct {
+    set *other;
+    set *out;
+} lookup_args;
+
+static void insert_if_missing(void *elem, void *extra) {
+    lookup_args *args = extra;
+    if (!set_contains(args->other, elem, NULL)) {
+        set_insert(args->out, elem);
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    unsigned order = argc > 2 ? strtoul(argv[2], NULL, 10) : 32;
+
+    set a, b, out;
+    set_u64_init(&a, order);
+    set_u64_init(&b, order);
+    set_u64_init(&out, order);
+    uint64_t seed = 1;
+    for (size_t i = 0; i < n; ++i) {
+        set_u64_insert(&a, bench_rand(&seed) % (2 * n));
+        set_u64_insert(&b, bench_rand(&seed) % (2 * n));
+    }
+
+    printf("operation,elements_out,seconds\n");
+    const char *names[] = {"union", "intersect", "difference", "symdiff"};
+    size_t (*ops[])(set *, set *, set *) = {set_union, set_intersect,
+                                            set_difference, set_symdiff};
+    for (size_t op = 0; op < 4; ++op) {
+        double start = bench_now();
+        size_t n_out = ops[op](&out, &a, &b);
+        printf("%s,%zu,%.4f\n", names[op], n_out, bench_now() - start);
+    }
+    set_free(&out);
+    double start = bench_now();
+    set_map(&a, insert_if_missing, &(lookup_args){&b, &out});
+    printf("difference_by_lookup,%zu,%.4f\n", set_size(&out),
+           bench_now() - start);
+
+    set_free(&a);
+    set_free(&b);
+    set_free(&out);
+    return 0;
+}
@@ -0,0 +1,118 @@
+/* Calibration of set_auto_order. For each element size, lookup and insert
+ * throughput of a set of `n` random keys across a sweep of orders, and then
+ * for the orders set_auto_order picks for each target, in sets made with the
+ * `_init_auto` functions and so with aligned nodes. Elements of 4 and 8 bytes
+ * use the typed u32 and u64 sets; larger ones are generic, with the key in
+ * their first 8 bytes. Rows chosen by a target are marked with its name, so
+ * the picks can be checked against the best orders on the host. If another
+ * size suits a target better, override SET_CACHE_LINE, SET_L2_NODE_BYTES or
+ * SET_PAGE_BYTES.
+ *
+ * Build: cc -O2 -D_POSIX_C_SOURCE=200809L -I.. auto_order.c ../set.c -pthread \
+ *            -o auto_order
+ * Usage: ./auto_order [n] [n_lookups]
+ */
+#include "../set.h"
+#include "bench.h"
+#include <stdlib.h>
+#include <string.h>
+
+// element of up to 64 bytes holding key `key`
+static void make_elem(char *elem, size_t elem_size, uint64_t key) {
+    memset(elem, 0, elem_size);
+    if (elem_size == 4) {
+        uint32_t key32 = (uint32_t)key;
+        memcpy(elem, &key32, sizeof(key32));
+    }
+    else {
+        memcpy(elem, &key, sizeof(key));
+    }
+}
+
+static void init(set *s, size_t elem_size, unsigned order) {
+    if (elem_size == 4) {
+        set_u32_init(s, order);
+    }
+    else if (elem_size == 8) {
+        set_u64_init(s, order);
+    }
+    else {
+        set_init(s, order, bench_less_u64, elem_size);
+    }
+}
+
+static unsigned init_auto(set *s, size_t elem_size,
+                          enum set_node_target target) {
+    if (elem_size == 4) {
+        return set_u32_init_auto(s, target);
+    }
+    if (elem_size == 8) {
+        return set_u64_init_auto(s, target);
+    }
+    return set_init_auto(s, bench_less_u64, elem_size, target);
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    size_t n_lookups = argc > 2 ? strtoull(argv[2], NULL, 10) : 2000000;
+    static const size_t elem_sizes[] = {4, 8, 16, 32, 64};
+    static const unsigned sweep[] = {4, 8, 16, 32, 64, 128, 256, 512, 1024};
+    static const char *target_names[] = {"line", "l2", "page"};
+
+    uint64_t *keys = malloc(n * sizeof(uint64_t));
+    uint64_t *probes = malloc(n_lookups * sizeof(uint64_t));
+    printf("elem_size,order,target,insert_mops_per_sec,lookup_mops_per_sec\n");
+    for (size_t e = 0; e < sizeof(elem_sizes) / sizeof(elem_sizes[0]); ++e) {
+        size_t elem_size = elem_sizes[e];
+        bench_fill_random(keys, n, 1);
+        if (elem_size == 4) {
+            for (size_t i = 0; i < n; ++i) {
+                keys[i] = (uint32_t)keys[i];
+            }
+        }
+        for (size_t i = 0; i < n_lookups; ++i) {
+            probes[i] = keys[i % n];
+        }
+        bench_shuffle(probes, n_lookups, 2);
+        // the sweep, then the three picks
+        size_t n_sweep = sizeof(sweep) / sizeof(sweep[0]);
+        for (size_t o = 0; o < n_sweep + 3; ++o) {
+            const char *target = "";
+            unsigned order;
+            char elem[64];
+            set s;
+            if (o < n_sweep) {
+                order = sweep[o];
+                init(&s, elem_size, order);
+            }
+            else {
+                target = target_names[o - n_sweep];
+                order = init_auto(&s, elem_size, o - n_sweep);
+            }
+            double start = bench_now();
+            for (size_t i = 0; i < n; ++i) {
+                make_elem(elem, elem_size, keys[i]);
+                set_insert(&s, elem);
+            }
+            double insert = bench_now() - start;
+            size_t found = 0;
+            start = bench_now();
+            for (size_t i = 0; i < n_lookups; ++i) {
+                make_elem(elem, elem_size, probes[i]);
+                found += set_contains(&s, elem, NULL);
+            }
+            double lookup = bench_now() - start;
+            set_free(&s);
+            if (found != n_lookups) {
+                fprintf(stderr, "lost keys: %zu of %zu found\n", found,
+                        n_lookups);
+                return 1;
+            }
+            printf("%zu,%u,%s,%.2f,%.2f\n", elem_size, order, target,
+                   n / insert / 1e6, n_lookups / lookup / 1e6);
+        }
+    }
+    free(keys);
+    free(probes);
+    return 0;
+}
@@ -0,0 +1,66 @@
+/* Insert throughput of set_insert_batch against a set_insert loop, for
+ * simulation-style ticks: a set of `n_keys` random keys receives `n_ticks`
+ * batches of `batch` new keys, either uniformly random or clustered (runs of
+ * consecutive keys, like neighbouring cells).
+ *
+ * Build: cc -O2 -D_POSIX_C_SOURCE=200809L -I.. batch_insert.c ../set.c \
+ *            -o batch_insert
+ * Usage: ./batch_insert [n_keys] [batch] [n_ticks] [order]
+ */
+#include "../set.h"
+#include "bench.h"
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char **argv) {
+    size_t n_keys = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    size_t batch = argc > 2 ? strtoull(argv[2], NULL, 10) : 50000;
+    size_t n_ticks = argc > 3 ? strtoull(argv[3], NULL, 10) : 20;
+    unsigned order = argc > 4 ? strtoul(argv[4], NULL, 10) : 32;
+
+    uint64_t *keys = malloc(n_keys * sizeof(uint64_t));
+    uint64_t *ticks = malloc(batch * n_ticks * sizeof(uint64_t));
+    bench_fill_random(keys, n_keys, 1);
+
+    printf("workload,method,minserts_per_sec\n");
+    for (int clustered = 0; clustered < 2; ++clustered) {
+        uint64_t seed = 2;
+        for (size_t i = 0; i < batch * n_ticks; ++i) {
+            if (clustered && i % 64) {
+                ticks[i] = ticks[i - 1] + 1;
+            }
+            else {
+                ticks[i] = bench_rand(&seed);
+            }
+        }
+        for (int batched = 0; batched < 2; ++batched) {
+            set s;
+            set_u64_init(&s, order);
+            uint64_t *sorted = malloc(n_keys * sizeof(uint64_t));
+            memcpy(sorted, keys, n_keys * sizeof(uint64_t));
+            set_insert_batch(&s, sorted, n_keys);
+            free(sorted);
+
+            double start = bench_now();
+            for (size_t tick = 0; tick < n_ticks; ++tick) {
+                uint64_t *elems = ticks + tick * batch;
+                if (batched) {
+                    set_insert_batch(&s, elems, batch);
+                }
+                else {
+                    for (size_t i = 0; i < batch; ++i) {
+                        set_insert(&s, &elems[i]);
+                    }
+                }
+            }
+            double elapsed = bench_now() - start;
+            printf("%s,%s,%.3f\n", clustered ? "clustered" : "random",
+                   batched ? "set_insert_batch" : "set_insert",
+                   batch * n_ticks / elapsed / 1e6);
+            set_free(&s);
+        }
+    }
+    free(keys);
+    free(ticks);
+    return 0;
+}
@@ -0,0 +1,45 @@
+#pragma once
+/* Helpers shared by the set benchmarks.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// monotonic wall-clock time in seconds
+static inline double bench_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// xorshift64 generator; deterministic for a given seed so runs are
+// reproducible
+static inline uint64_t bench_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// fill `keys` with `n` pseudo-random values
+static inline void bench_fill_random(uint64_t *keys, size_t n, uint64_t seed) {
+    for (size_t i = 0; i < n; ++i) {
+        keys[i] = bench_rand(&seed);
+    }
+}
+
+// Fisher-Yates shuffle of `keys`
+static inline void bench_shuffle(uint64_t *keys, size_t n, uint64_t seed) {
+    for (size_t i = n; i > 1; --i) {
+        size_t j = bench_rand(&seed) % i;
+        uint64_t tmp = keys[i - 1];
+        keys[i - 1] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+static inline bool bench_less_u64(void *x, void *y) {
+    return *(uint64_t *)x < *(uint64_t *)y;
+}
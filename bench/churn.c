@@ -0,0 +1,63 @@
+/* Long-running insert/erase churn. A set holding `n_keys` random keys
+ * alternates between inserting a new random key and erasing a random live
+ * one, for `n_ops` operations in total, so its size stays constant. Prints
+ * throughput, lookup speed, tree height and mean leaf fill (from set_inspect)
+ * for each tenth of the run: if rebalancing keeps nodes dense, none of them
+ * degrades as the run goes on.
+ *
+ * Build: cc -O2 -D_POSIX_C_SOURCE=200809L -I.. churn.c ../set.c -o churn
+ * Usage: ./churn [n_keys] [n_ops] [order]
+ */
+#include "../set.h"
+#include "bench.h"
+#include <stdlib.h>
+
+int main(int argc, char **argv) {
+    size_t n_keys = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    size_t n_ops = argc > 2 ? strtoull(argv[2], NULL, 10) : 100000000;
+    unsigned order = argc > 3 ? strtoul(argv[3], NULL, 10) : 32;
+
+    // live keys, so a random one can be picked for erasing
+    uint64_t *live = malloc(n_keys * sizeof(uint64_t));
+    bench_fill_random(live, n_keys, 1);
+    set s;
+    set_u64_init(&s, order);
+    for (size_t i = 0; i < n_keys; ++i) {
+        set_u64_insert(&s, live[i]);
+    }
+
+    uint64_t seed = 2;
+    size_t window = n_ops / 10 ? n_ops / 10 : 1;
+    printf("ops_done,mops_per_sec,lookup_mops_per_sec,height,leaf_fill\n");
+    for (size_t done = 0; done < n_ops; done += window) {
+        double start = bench_now();
+        for (size_t op = 0; op < window; op += 2) {
+            size_t victim = bench_rand(&seed) % n_keys;
+            set_erase(&s, &live[victim], NULL);
+            live[victim] = bench_rand(&seed);
+            set_u64_insert(&s, live[victim]);
+        }
+        double elapsed = bench_now() - start;
+        // lookups of live keys, to check the tree has not degraded
+        size_t n_lookups = n_keys < 1000000 ? n_keys : 1000000;
+        start = bench_now();
+        size_t found = 0;
+        for (size_t i = 0; i < n_lookups; ++i) {
+            found += set_u64_contains(&s, live[bench_rand(&seed) % n_keys],
+                                      NULL);
+        }
+        double lookup_elapsed = bench_now() - start;
+        if (found != n_lookups) {
+            fprintf(stderr, "lost keys: %zu of %zu found\n", found, n_lookups);
+            return 1;
+        }
+        set_report report;
+        set_inspect(&s, &report);
+        printf("%zu,%.3f,%.3f,%zu,%.3f\n", done + window,
+               window / elapsed / 1e6, n_lookups / lookup_elapsed / 1e6,
+               report.height, report.mean_leaf_fill);
+    }
+    set_free(&s);
+    free(live);
+    return 0;
+}
@@ -0,0 +1,98 @@
+/* A `less` against a three-way `cmp` for costly keys. A set of `n` string
+ * keys (fixed-size records sharing a long prefix, so each comparison scans
+ * it) is built once with a `less` and once with an equivalent `cmp`, and
+ * `n_lookups` random keys (half of them hits) are looked up in each. For
+ * orders using linear and binary search within nodes, prints the comparator
+ * calls per insert and per lookup, and lookup throughput.
+ *
+ * Build: cc -O2 -D_POSIX_C_SOURCE=200809L -I.. compare.c ../set.c -pthread -o compare
+ * Usage: ./compare [n] [n_lookups]
+ */
+#include "../set.h"
+#include "bench.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct record {
+    char name[48];
+} record;
+
+static uint64_t n_calls;
+
+static bool record_less(void *x, void *y) {
+    ++n_calls;
+    return strcmp(((record *)x)->name, ((record *)y)->name) < 0;
+}
+
+static int record_cmp(const void *x, const void *y, void *ctx) {
+    ++*(uint64_t *)ctx;
+    return strcmp(((const record *)x)->name, ((const record *)y)->name);
+}
+
+static void make_record(record *r, uint64_t key) {
+    memset(r, 0, sizeof(*r));
+    snprintf(r->name, sizeof(r->name), "/var/lib/service/objects/%016llx",
+             (unsigned long long)key);
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    size_t n_lookups = argc > 2 ? strtoull(argv[2], NULL, 10) : 2000000;
+    static const unsigned orders[] = {16, 64, 256};
+
+    uint64_t *keys = malloc(n * sizeof(uint64_t));
+    uint64_t *probes = malloc(n_lookups * sizeof(uint64_t));
+    bench_fill_random(keys, n, 1);
+    uint64_t seed = 2;
+    for (size_t i = 0; i < n_lookups; ++i) {
+        // a miss is a key with its low bit flipped, so it shares a long
+        // prefix with the keys around it
+        uint64_t key = keys[bench_rand(&seed) % n];
+        probes[i] = bench_rand(&seed) % 2 ? key : key ^ 1;
+    }
+    printf("order,comparator,insert_calls_per_op,lookup_calls_per_op,"
+           "lookup_mops_per_sec\n");
+    for (size_t o = 0; o < sizeof(orders) / sizeof(orders[0]); ++o) {
+        size_t less_found = 0;
+        for (int three_way = 0; three_way < 2; ++three_way) {
+            set s;
+            if (three_way) {
+                set_init_cmp(&s, orders[o], record_cmp, &n_calls,
+                             sizeof(record));
+            }
+            else {
+                set_init(&s, orders[o], record_less, sizeof(record));
+            }
+            record r;
+            n_calls = 0;
+            for (size_t i = 0; i < n; ++i) {
+                make_record(&r, keys[i]);
+                set_insert(&s, &r);
+            }
+            double insert_calls = (double)n_calls / n;
+            n_calls = 0;
+            size_t found = 0;
+            double start = bench_now();
+            for (size_t i = 0; i < n_lookups; ++i) {
+                make_record(&r, probes[i]);
+                found += set_contains(&s, &r, NULL);
+            }
+            double lookup = bench_now() - start;
+            printf("%u,%s,%.1f,%.1f,%.2f\n", orders[o],
+                   three_way ? "cmp" : "less", insert_calls,
+                   (double)n_calls / n_lookups, n_lookups / lookup / 1e6);
+            set_free(&s);
+            if (!three_way) {
+                less_found = found;
+            }
+            else if (found != less_found) {
+                fprintf(stderr, "lookups disagree: %zu, %zu\n", less_found,
+                        found);
+                return 1;
+            }
+        }
+    }
+    free(keys);
+    free(probes);
+    return 0;
+}
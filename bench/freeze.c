@@ -0,0 +1,75 @@
+/* Lookups in a frozen set against the live tree. For n = 10^6, 10^7, ... up
+ * to `max_n`, a set of n keys spread over [0, 4n) is bulk-loaded with full
+ * nodes, and `n_lookups` random keys from that range (a quarter of them hits)
+ * are looked up with set_contains, then with set_contains_batch, and then
+ * again with set_contains after set_freeze. Prints lookup throughput for
+ * each, and the cost of freezing and thawing.
+ *
+ * Build: cc -O2 -D_POSIX_C_SOURCE=200809L -I.. freeze.c ../set.c -pthread -o freeze
+ * Usage: ./freeze [max_n] [n_lookups] [order]
+ */
+#include "../set.h"
+#include "bench.h"
+#include <stdlib.h>
+
+int main(int argc, char **argv) {
+    size_t max_n = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+    size_t n_lookups = argc > 2 ? strtoull(argv[2], NULL, 10) : 10000000;
+    unsigned order = argc > 3 ? strtoul(argv[3], NULL, 10) : 64;
+
+    uint64_t *probes = malloc(n_lookups * sizeof(uint64_t));
+    bool *out = malloc(n_lookups * sizeof(bool));
+    printf("n,tree_mops_per_sec,tree_batch_mops_per_sec,"
+           "frozen_mops_per_sec,freeze_ms,thaw_ms\n");
+    for (size_t n = 1000000; n <= max_n; n *= 10) {
+        uint64_t seed = 1;
+        uint64_t *keys = malloc(n * sizeof(uint64_t));
+        for (size_t i = 0; i < n; ++i) {
+            keys[i] = i * 4 + bench_rand(&seed) % 4;
+        }
+        for (size_t i = 0; i < n_lookups; ++i) {
+            probes[i] = bench_rand(&seed) % (4 * n);
+        }
+        set s;
+        set_u64_init(&s, order);
+        set_build_sorted(&s, keys, n, 1);
+        free(keys);
+
+        size_t found = 0;
+        double start = bench_now();
+        for (size_t i = 0; i < n_lookups; ++i) {
+            found += set_u64_contains(&s, probes[i], NULL);
+        }
+        double tree = bench_now() - start;
+        start = bench_now();
+        size_t batch_found = set_contains_batch(&s, probes, n_lookups, out,
+                                                NULL);
+        double batch = bench_now() - start;
+
+        start = bench_now();
+        set_freeze(&s);
+        double freeze = bench_now() - start;
+        size_t frozen_found = 0;
+        start = bench_now();
+        for (size_t i = 0; i < n_lookups; ++i) {
+            frozen_found += set_u64_contains(&s, probes[i], NULL);
+        }
+        double frozen = bench_now() - start;
+        start = bench_now();
+        set_thaw(&s);
+        double thaw = bench_now() - start;
+        set_free(&s);
+
+        if (batch_found != found || frozen_found != found) {
+            fprintf(stderr, "lookups disagree: %zu, %zu, %zu\n", found,
+                    batch_found, frozen_found);
+            return 1;
+        }
+        printf("%zu,%.2f,%.2f,%.2f,%.1f,%.1f\n", n, n_lookups / tree / 1e6,
+               n_lookups / batch / 1e6, n_lookups / frozen / 1e6,
+               freeze * 1e3, thaw * 1e3);
+    }
+    free(probes);
+    free(out);
+    return 0;
+}
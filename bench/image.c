@@ -0,0 +1,83 @@
+/* Cold start from an image. A set of `n` keys is written with
+ * set_image_write to `path`, which is then flushed and dropped from the page
+ * cache, so the first lookups read from disk as after a restart. Prints the
+ * time to map and open the image, the latency of the first lookup and the
+ * mean of the next 1000 (random, mostly cold), the time to promote the image
+ * to an ordinary set, and, for comparison, the time to rebuild the set with
+ * set_insert.
+ *
+ * Build: cc -O2 -D_POSIX_C_SOURCE=200809L -I.. image.c ../set.c -pthread -o image
+ * Usage: ./image [path] [n] [order]
+ */
+#include "../set.h"
+#include "bench.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "image.set";
+    size_t n = argc > 2 ? strtoull(argv[2], NULL, 10) : 10000000;
+    unsigned order = argc > 3 ? strtoul(argv[3], NULL, 10) : 64;
+
+    // sorted distinct keys, spread over [0, 4n)
+    uint64_t seed = 1;
+    uint64_t *keys = malloc(n * sizeof(uint64_t));
+    for (size_t i = 0; i < n; ++i) {
+        keys[i] = i * 4 + bench_rand(&seed) % 4;
+    }
+    set s;
+    set_u64_init(&s, order);
+    set_build_sorted(&s, keys, n, 1);
+    FILE *out = fopen(path, "wb");
+    if (!out || !set_image_write(&s, out) || fsync(fileno(out)) != 0) {
+        perror(path);
+        return 1;
+    }
+    fclose(out);
+    set_free(&s);
+
+    int fd = open(path, O_RDONLY);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    double start = bench_now();
+    size_t size = lseek(fd, 0, SEEK_END);
+    void *image = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED || !set_image_open(&s, image, size, NULL)) {
+        fprintf(stderr, "%s: cannot open image\n", path);
+        return 1;
+    }
+    double open_ms = (bench_now() - start) * 1e3;
+    start = bench_now();
+    uint64_t probe = bench_rand(&seed) % (4 * n);
+    size_t found = set_u64_contains(&s, probe, NULL);
+    double first_ms = (bench_now() - start) * 1e3;
+    start = bench_now();
+    for (int i = 0; i < 1000; ++i) {
+        probe = bench_rand(&seed) % (4 * n);
+        found += set_u64_contains(&s, probe, NULL);
+    }
+    double lookup_us = (bench_now() - start) * 1e3;
+    start = bench_now();
+    set_image_promote(&s);
+    double promote_ms = (bench_now() - start) * 1e3;
+    munmap(image, size);
+    close(fd);
+    set_free(&s);
+
+    bench_shuffle(keys, n, 2);
+    start = bench_now();
+    set_u64_init(&s, order);
+    for (size_t i = 0; i < n; ++i) {
+        set_u64_insert(&s, keys[i]);
+    }
+    double insert_ms = (bench_now() - start) * 1e3;
+    set_free(&s);
+    free(keys);
+
+    printf("n,image_mb,open_ms,first_lookup_ms,cold_lookup_us,promote_ms,"
+           "insert_rebuild_ms,found\n");
+    printf("%zu,%.1f,%.3f,%.3f,%.2f,%.1f,%.1f,%zu\n", n, size / 1e6, open_ms,
+           first_ms, lookup_us, promote_ms, insert_ms, found);
+    return 0;
+}
@@ -0,0 +1,74 @@
+/* Scaling of set_map_parallel. Maps a callback costing about `work` rounds of
+ * a random number generator over a set of `n` keys with 1, 2, 4, ... up to
+ * `max_threads` threads, and prints the time and speedup over one thread.
+ * Each thread accumulates into its own slot of `extra`.
+ *
+ * Build: cc -O2 -D_POSIX_C_SOURCE=200809L -I.. map_parallel.c ../set.c -pthread -o map_parallel
+ * Usage: ./map_parallel [n] [work] [max_threads] [order]
+ */
+#include "../set.h"
+#include "bench.h"
+#include <stdlib.h>
+
+typedef struct {
+    uint64_t sum;
+    size_t work;
+    char pad[48]; // keep each thread's slot on its own cache line
+} slot;
+
+static void update(void *elem, void *extra) {
+    slot *acc = extra;
+    uint64_t x = *(uint64_t *)elem | 1;
+    for (size_t i = 0; i < acc->work; ++i) {
+        bench_rand(&x);
+    }
+    acc->sum += x;
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+    size_t work = argc > 2 ? strtoull(argv[2], NULL, 10) : 20;
+    size_t max_threads = argc > 3 ? strtoull(argv[3], NULL, 10) : 64;
+    unsigned order = argc > 4 ? strtoul(argv[4], NULL, 10) : 32;
+
+    uint64_t *keys = malloc(n * sizeof(uint64_t));
+    for (size_t i = 0; i < n; ++i) {
+        keys[i] = i;
+    }
+    set s;
+    set_u64_init(&s, order);
+    set_build_sorted(&s, keys, n, 1);
+    free(keys);
+
+    slot *slots = malloc(max_threads * sizeof(slot));
+    void **extra = malloc(max_threads * sizeof(void *));
+    double base = 0;
+    uint64_t expected = 0;
+    printf("threads,seconds,speedup\n");
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        for (size_t i = 0; i < threads; ++i) {
+            slots[i] = (slot){0, work, {0}};
+            extra[i] = &slots[i];
+        }
+        double start = bench_now();
+        set_map_parallel(&s, update, extra, threads);
+        double elapsed = bench_now() - start;
+        uint64_t sum = 0;
+        for (size_t i = 0; i < threads; ++i) {
+            sum += slots[i].sum;
+        }
+        if (threads == 1) {
+            base = elapsed;
+            expected = sum;
+        }
+        else if (sum != expected) {
+            fprintf(stderr, "checksum mismatch at %zu threads\n", threads);
+            return 1;
+        }
+        printf("%zu,%.4f,%.2f\n", threads, elapsed, base / elapsed);
+    }
+    free(extra);
+    free(slots);
+    set_free(&s);
+    return 0;
+}
@@ -0,0 +1,58 @@
+/* Lookup throughput of linear vs binary search within nodes, across orders.
+ * The order where binary search overtakes linear search is a good value for
+ * SET_BINARY_SEARCH_ORDER on the host.
+ *
+ * Build: cc -O2 -D_POSIX_C_SOURCE=200809L -I.. search.c ../set.c -o search
+ * Usage: ./search [n_keys] [n_lookups]
+ */
+#include "../set.h"
+#include "bench.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+static double lookups_per_sec(set *s, uint64_t *probes, size_t n_probes) {
+    size_t found = 0;
+    double start = bench_now();
+    for (size_t i = 0; i < n_probes; ++i) {
+        found += set_contains(s, &probes[i], NULL);
+    }
+    double elapsed = bench_now() - start;
+    if (found != n_probes) {
+        fprintf(stderr, "lost keys: %zu of %zu found\n", found, n_probes);
+        exit(1);
+    }
+    return n_probes / elapsed;
+}
+
+int main(int argc, char **argv) {
+    size_t n_keys = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    size_t n_probes = argc > 2 ? strtoull(argv[2], NULL, 10) : 2000000;
+    static const unsigned orders[] = {4, 8, 12, 16, 24, 32, 48, 64, 96, 128,
+                                      192, 256, 384, 512, 1024};
+
+    uint64_t *keys = malloc(n_keys * sizeof(uint64_t));
+    uint64_t *probes = malloc(n_probes * sizeof(uint64_t));
+    bench_fill_random(keys, n_keys, 1);
+    for (size_t i = 0; i < n_probes; ++i) {
+        probes[i] = keys[i % n_keys];
+    }
+    bench_shuffle(probes, n_probes, 2);
+
+    printf("order,linear_mops,binary_mops\n");
+    for (size_t o = 0; o < sizeof(orders) / sizeof(orders[0]); ++o) {
+        set s;
+        set_init(&s, orders[o], bench_less_u64, sizeof(uint64_t));
+        for (size_t i = 0; i < n_keys; ++i) {
+            set_insert(&s, &keys[i]);
+        }
+        s.binary_search = false;
+        double linear = lookups_per_sec(&s, probes, n_probes);
+        s.binary_search = true;
+        double binary = lookups_per_sec(&s, probes, n_probes);
+        printf("%u,%.3f,%.3f\n", orders[o], linear / 1e6, binary / 1e6);
+        set_free(&s);
+    }
+    free(keys);
+    free(probes);
+    return 0;
+}
@@ -0,0 +1,155 @@
+/* Multi-writer stress test and benchmark for set_insert_shared. For 1, 2, 4,
+ * ... up to `max_writers` writer threads, each writer inserts its own share
+ * of `n` random keys (every key is inserted by two writers, so duplicates
+ * race too) while `n_readers` threads look up keys already inserted. Then
+ * every key is checked to be present exactly once. The same runs are repeated
+ * with a global mutex around set_insert and set_contains as a baseline.
+ * Prints insert and lookup throughput for each.
+ *
+ * Build: cc -O2 -D_POSIX_C_SOURCE=200809L -I.. shared_insert.c ../set.c -pthread -o shared_insert
+ * Usage: ./shared_insert [n] [max_writers] [n_readers] [order]
+ */
+#include "../set.h"
+#include "bench.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+static set s;
+static uint64_t *keys;
+static size_t n;
+static size_t n_writers;
+static bool use_mutex;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_size_t inserted; // keys[0, inserted) are in the set
+static atomic_bool stop;
+
+typedef struct {
+    size_t index;
+    size_t ops;
+} worker;
+
+static void *writer(void *arg) {
+    worker *w = arg;
+    // writer i inserts slices i and i + 1 of the keys, so each key is
+    // inserted by two writers
+    for (size_t slice = w->index; slice < w->index + 2; ++slice) {
+        size_t start = n * (slice % n_writers) / n_writers;
+        size_t end = n * (slice % n_writers + 1) / n_writers;
+        for (size_t i = start; i < end; ++i) {
+            if (use_mutex) {
+                pthread_mutex_lock(&mutex);
+                set_insert(&s, &keys[i]);
+                pthread_mutex_unlock(&mutex);
+            }
+            else {
+                set_insert_shared(&s, &keys[i]);
+            }
+            ++w->ops;
+        }
+    }
+    return NULL;
+}
+
+static void *reader(void *arg) {
+    worker *w = arg;
+    uint64_t seed = w->index + 1;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        size_t known = atomic_load_explicit(&inserted, memory_order_acquire);
+        if (known == 0) {
+            continue;
+        }
+        uint64_t key = keys[bench_rand(&seed) % known];
+        bool found;
+        if (use_mutex) {
+            pthread_mutex_lock(&mutex);
+            found = set_contains(&s, &key, NULL);
+            pthread_mutex_unlock(&mutex);
+        }
+        else {
+            found = set_contains_shared(&s, &key, NULL);
+        }
+        if (!found) {
+            fprintf(stderr, "lost key %llu\n", (unsigned long long)key);
+            exit(1);
+        }
+        ++w->ops;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    n = argc > 1 ? strtoull(argv[1], NULL, 10) : 4000000;
+    size_t max_writers = argc > 2 ? strtoull(argv[2], NULL, 10) : 32;
+    size_t n_readers = argc > 3 ? strtoull(argv[3], NULL, 10) : 2;
+    unsigned order = argc > 4 ? strtoul(argv[4], NULL, 10) : 32;
+
+    keys = malloc(n * sizeof(uint64_t));
+    bench_fill_random(keys, n, 1);
+    size_t n_threads = max_writers + n_readers;
+    worker *workers = malloc(n_threads * sizeof(worker));
+    pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+    printf("mode,writers,readers,insert_mops_per_sec,lookup_mops_per_sec\n");
+    for (int mode = 0; mode < 2; ++mode) {
+        use_mutex = mode;
+        for (n_writers = 1; n_writers <= max_writers; n_writers *= 2) {
+            set_u64_init(&s, order);
+            // readers may only look up keys which a first pass inserted
+            size_t warm = n / 4;
+            for (size_t i = 0; i < warm; ++i) {
+                set_insert(&s, &keys[i]);
+            }
+            atomic_store(&inserted, warm);
+            atomic_store(&stop, false);
+            for (size_t i = 0; i < n_writers + n_readers; ++i) {
+                workers[i] = (worker){i, 0};
+                pthread_create(&threads[i], NULL,
+                               i < n_writers ? writer : reader, &workers[i]);
+            }
+            double start = bench_now();
+            size_t insert_ops = 0;
+            for (size_t i = 0; i < n_writers; ++i) {
+                pthread_join(threads[i], NULL);
+                insert_ops += workers[i].ops;
+            }
+            double elapsed = bench_now() - start;
+            atomic_store(&stop, true);
+            size_t lookup_ops = 0;
+            for (size_t i = n_writers; i < n_writers + n_readers; ++i) {
+                pthread_join(threads[i], NULL);
+                lookup_ops += workers[i].ops;
+            }
+            // every key present, and no duplicates
+            size_t distinct = 0;
+            set_iter it;
+            set_iter_begin(&s, &it);
+            for (uint64_t *prev = NULL, *elem; (elem = set_iter_next(&it));
+                 prev = elem) {
+                if (prev && *prev >= *elem) {
+                    fprintf(stderr, "keys out of order\n");
+                    return 1;
+                }
+                ++distinct;
+            }
+            for (size_t i = 0; i < n; ++i) {
+                if (!set_u64_contains(&s, keys[i], NULL)) {
+                    fprintf(stderr, "lost key %zu\n", i);
+                    return 1;
+                }
+            }
+            if (distinct != set_size(&s)) {
+                fprintf(stderr, "size %zu, but %zu keys\n", set_size(&s),
+                        distinct);
+                return 1;
+            }
+            printf("%s,%zu,%zu,%.3f,%.3f\n", use_mutex ? "mutex" : "shared",
+                   n_writers, n_readers, insert_ops / elapsed / 1e6,
+                   lookup_ops / elapsed / 1e6);
+            set_free(&s);
+        }
+    }
+    free(threads);
+    free(workers);
+    free(keys);
+    return 0;
+}
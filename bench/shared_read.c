@@ -0,0 +1,117 @@
+/* Reader throughput of set_contains_shared while one writer inserts. A set is
+ * loaded with `n` random keys, then for 1, 2, 4, ... up to `max_readers`
+ * reader threads, the readers look up random loaded keys while one writer
+ * thread inserts fresh random keys, for `seconds` per step. The same runs are
+ * repeated with a global mutex around set_contains and set_insert instead, as
+ * a baseline. Prints total reader and writer throughput for each.
+ *
+ * Build: cc -O2 -D_POSIX_C_SOURCE=200809L -I.. shared_read.c ../set.c -pthread -o shared_read
+ * Usage: ./shared_read [n] [max_readers] [seconds] [order]
+ */
+#include "../set.h"
+#include "bench.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+static set s;
+static uint64_t *keys;
+static size_t n;
+static bool use_mutex;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool stop;
+
+typedef struct {
+    uint64_t seed;
+    size_t ops;
+} worker;
+
+static void *reader(void *arg) {
+    worker *w = arg;
+    size_t ops = 0;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        uint64_t key = keys[bench_rand(&w->seed) % n];
+        bool found;
+        if (use_mutex) {
+            pthread_mutex_lock(&mutex);
+            found = set_contains(&s, &key, NULL);
+            pthread_mutex_unlock(&mutex);
+        }
+        else {
+            found = set_contains_shared(&s, &key, NULL);
+        }
+        if (!found) {
+            fprintf(stderr, "lost key %llu\n", (unsigned long long)key);
+            exit(1);
+        }
+        ++ops;
+    }
+    w->ops = ops;
+    return NULL;
+}
+
+static void *writer(void *arg) {
+    worker *w = arg;
+    size_t ops = 0;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        uint64_t key = bench_rand(&w->seed);
+        if (use_mutex) {
+            pthread_mutex_lock(&mutex);
+            set_insert(&s, &key);
+            pthread_mutex_unlock(&mutex);
+        }
+        else {
+            set_insert(&s, &key);
+        }
+        ++ops;
+    }
+    w->ops = ops;
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    n = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    size_t max_readers = argc > 2 ? strtoull(argv[2], NULL, 10) : 32;
+    double seconds = argc > 3 ? strtod(argv[3], NULL) : 1;
+    unsigned order = argc > 4 ? strtoul(argv[4], NULL, 10) : 32;
+
+    keys = malloc(n * sizeof(uint64_t));
+    bench_fill_random(keys, n, 1);
+    worker *workers = malloc((max_readers + 1) * sizeof(worker));
+    pthread_t *threads = malloc((max_readers + 1) * sizeof(pthread_t));
+    printf("mode,readers,reader_mops_per_sec,writer_mops_per_sec\n");
+    for (int mode = 0; mode < 2; ++mode) {
+        use_mutex = mode;
+        for (size_t readers = 1; readers <= max_readers; readers *= 2) {
+            set_u64_init(&s, order);
+            for (size_t i = 0; i < n; ++i) {
+                set_u64_insert(&s, keys[i]);
+            }
+            atomic_store(&stop, false);
+            for (size_t i = 0; i <= readers; ++i) {
+                workers[i] = (worker){i + 2, 0};
+                pthread_create(&threads[i], NULL, i ? reader : writer,
+                               &workers[i]);
+            }
+            double start = bench_now();
+            while (bench_now() - start < seconds) {
+                nanosleep(&(struct timespec){0, 1000000}, NULL);
+            }
+            atomic_store(&stop, true);
+            size_t read_ops = 0;
+            for (size_t i = 0; i <= readers; ++i) {
+                pthread_join(threads[i], NULL);
+                read_ops += i ? workers[i].ops : 0;
+            }
+            double elapsed = bench_now() - start;
+            printf("%s,%zu,%.3f,%.3f\n", use_mutex ? "mutex" : "shared",
+                   readers, read_ops / elapsed / 1e6,
+                   workers[0].ops / elapsed / 1e6);
+            set_free(&s);
+        }
+    }
+    free(threads);
+    free(workers);
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,89 @@
+/* Lookup throughput of the typed integer sets with scalar, SSE2 and AVX2 node
+ * search, at orders 16, 32, 64 and 128, for 32 and 64 bit keys. Levels the
+ * CPU does not support are skipped. Keep `n_keys` small enough for the tree
+ * to stay in cache to isolate the cost of searching within nodes.
+ *
+ * Build: cc -O2 -D_POSIX_C_SOURCE=200809L -I.. simd.c ../set.c -o simd
+ * Usage: ./simd [n_keys] [n_lookups]
+ */
+#include "../set.h"
+#include "bench.h"
+#include <stdlib.h>
+
+static const char *simd_names[] = {"scalar", "sse2", "avx2"};
+
+static double lookups_per_sec(set *s, const uint64_t *probes, size_t n_probes,
+                              bool wide) {
+    size_t found = 0;
+    double start = bench_now();
+    for (size_t i = 0; i < n_probes; ++i) {
+        if (wide) {
+            found += set_u64_contains(s, probes[i], NULL);
+        }
+        else {
+            found += set_u32_contains(s, (uint32_t)probes[i], NULL);
+        }
+    }
+    double elapsed = bench_now() - start;
+    if (found != n_probes) {
+        fprintf(stderr, "lost keys: %zu of %zu found\n", found, n_probes);
+        exit(1);
+    }
+    return n_probes / elapsed;
+}
+
+int main(int argc, char **argv) {
+    size_t n_keys = argc > 1 ? strtoull(argv[1], NULL, 10) : 100000;
+    size_t n_probes = argc > 2 ? strtoull(argv[2], NULL, 10) : 5000000;
+    static const unsigned orders[] = {16, 32, 64, 128};
+
+    uint64_t *keys = malloc(n_keys * sizeof(uint64_t));
+    uint64_t *probes = malloc(n_probes * sizeof(uint64_t));
+    bench_fill_random(keys, n_keys, 1);
+    for (size_t i = 0; i < n_keys; ++i) {
+        // keep keys distinct when truncated to 32 bits
+        keys[i] = (keys[i] & ~(uint64_t)UINT32_MAX) | (uint32_t)i;
+    }
+    for (size_t i = 0; i < n_probes; ++i) {
+        probes[i] = keys[i % n_keys];
+    }
+    bench_shuffle(probes, n_probes, 2);
+
+    printf("key_bits,order,search,mops\n");
+    for (int wide = 0; wide < 2; ++wide) {
+        for (size_t o = 0; o < sizeof(orders) / sizeof(orders[0]); ++o) {
+            set s;
+            if (wide) {
+                set_u64_init(&s, orders[o]);
+            }
+            else {
+                set_u32_init(&s, orders[o]);
+            }
+            for (size_t i = 0; i < n_keys; ++i) {
+                if (wide) {
+                    set_u64_insert(&s, keys[i]);
+                }
+                else {
+                    set_u32_insert(&s, (uint32_t)keys[i]);
+                }
+            }
+            uint8_t best = s.simd;
+            s.binary_search = false;
+            for (uint8_t simd = SET_SIMD_NONE; simd <= best; ++simd) {
+                s.simd = simd;
+                double rate = lookups_per_sec(&s, probes, n_probes, wide);
+                printf("%d,%u,%s,%.3f\n", wide ? 64 : 32, orders[o],
+                       simd_names[simd], rate / 1e6);
+            }
+            s.binary_search = true;
+            s.simd = SET_SIMD_NONE;
+            double rate = lookups_per_sec(&s, probes, n_probes, wide);
+            printf("%d,%u,binary,%.3f\n", wide ? 64 : 32, orders[o],
+                   rate / 1e6);
+            set_free(&s);
+        }
+    }
+    free(keys);
+    free(probes);
+    return 0;
+}
@@ -0,0 +1,55 @@
+/* Cost of set_snapshot and of the copy-on-write it causes. A set of `n`
+ * random keys is built, then `n_ops` random inserts are timed in ten windows,
+ * once with no snapshot, and once with a snapshot taken before each window
+ * (and released after it). Prints the time to take a snapshot and the insert
+ * throughput of each window: inserts right after a snapshot copy their path,
+ * later ones mostly find it already copied.
+ *
+ * Build: cc -O2 -D_POSIX_C_SOURCE=200809L -I.. snapshot.c ../set.c -pthread -o snapshot
+ * Usage: ./snapshot [n] [n_ops] [order]
+ */
+#include "../set.h"
+#include "bench.h"
+#include <stdlib.h>
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    size_t n_ops = argc > 2 ? strtoull(argv[2], NULL, 10) : 1000000;
+    unsigned order = argc > 3 ? strtoul(argv[3], NULL, 10) : 32;
+
+    uint64_t *keys = malloc(n * sizeof(uint64_t));
+    bench_fill_random(keys, n, 1);
+    size_t window = n_ops / 10 ? n_ops / 10 : 1;
+    printf("snapshots,window,snapshot_ns,insert_mops_per_sec\n");
+    for (int snapshots = 0; snapshots < 2; ++snapshots) {
+        set s;
+        set_u64_init(&s, order);
+        for (size_t i = 0; i < n; ++i) {
+            set_u64_insert(&s, keys[i]);
+        }
+        uint64_t seed = 2;
+        for (size_t done = 0; done < n_ops; done += window) {
+            set *snapshot = NULL;
+            double snapshot_ns = 0;
+            if (snapshots) {
+                double start = bench_now();
+                snapshot = set_snapshot(&s);
+                snapshot_ns = (bench_now() - start) * 1e9;
+            }
+            double start = bench_now();
+            for (size_t op = 0; op < window; ++op) {
+                set_u64_insert(&s, bench_rand(&seed));
+            }
+            double elapsed = bench_now() - start;
+            if (snapshot) {
+                set_free(snapshot);
+                free(snapshot);
+            }
+            printf("%d,%zu,%.0f,%.3f\n", snapshots, done / window,
+                   snapshot_ns, window / elapsed / 1e6);
+        }
+        set_free(&s);
+    }
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,100 @@
+/* Streaming a set through set_write and set_read. For a dense set (keys
+ * 0, 2, 4, ...) and a sparse one (random 64-bit keys) of `n` elements,
+ * prints the bytes written per element, write and read throughput through a
+ * temporary file, and, for comparison, the time to rebuild the set by
+ * inserting its elements one by one. First checks that a stream whose header
+ * claims far more elements than it holds is rejected.
+ *
+ * Build: cc -O2 -D_POSIX_C_SOURCE=200809L -I.. stream.c ../set.c -pthread -o stream
+ * Usage: ./stream [n] [order]
+ */
+#include "../set.h"
+#include "bench.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Whether set_read rejects, leaving the set empty, the stream of a set of 100
+// elements with the element count in its header replaced by 2^62
+static bool rejects_corrupt_size(void) {
+    set s;
+    set_u64_init(&s, 64);
+    for (uint64_t i = 0; i < 100; ++i) {
+        set_u64_insert(&s, i);
+    }
+    FILE *file = tmpfile();
+    set_write(&s, file);
+    long length = ftell(file);
+    unsigned char *stream = malloc(length);
+    rewind(file);
+    fread(stream, 1, length, file);
+    // the header is the 8-byte magic, then one-byte varints of the version,
+    // element size, key kind and size (100)
+    static const unsigned char huge[] = {0x80, 0x80, 0x80, 0x80, 0x80,
+                                         0x80, 0x80, 0x80, 0x40};
+    rewind(file);
+    fwrite(stream, 1, 11, file);
+    fwrite(huge, 1, sizeof(huge), file);
+    fwrite(stream + 12, 1, length - 12, file);
+    rewind(file);
+    bool rejected = !set_read(&s, file) && set_size(&s) == 0;
+    fclose(file);
+    free(stream);
+    set_free(&s);
+    return rejected;
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+    unsigned order = argc > 2 ? strtoul(argv[2], NULL, 10) : 64;
+
+    if (!rejects_corrupt_size()) {
+        fprintf(stderr, "corrupt stream accepted\n");
+        return 1;
+    }
+    uint64_t *keys = malloc(n * sizeof(uint64_t));
+    printf("keys,bytes_per_elem,write_melems_per_sec,read_melems_per_sec,"
+           "insert_melems_per_sec\n");
+    for (int dense = 1; dense >= 0; --dense) {
+        if (dense) {
+            for (size_t i = 0; i < n; ++i) {
+                keys[i] = 2 * i;
+            }
+            bench_shuffle(keys, n, 1);
+        }
+        else {
+            bench_fill_random(keys, n, 1);
+        }
+        set s;
+        set_u64_init(&s, order);
+        double start = bench_now();
+        for (size_t i = 0; i < n; ++i) {
+            set_u64_insert(&s, keys[i]);
+        }
+        double insert = bench_now() - start;
+
+        FILE *file = tmpfile();
+        start = bench_now();
+        set_write(&s, file);
+        double write = bench_now() - start;
+        long bytes = ftell(file);
+        rewind(file);
+        set copy;
+        set_u64_init(&copy, order);
+        start = bench_now();
+        if (!set_read(&copy, file) || set_size(&copy) != set_size(&s)) {
+            fprintf(stderr, "round trip failed\n");
+            return 1;
+        }
+        double read = bench_now() - start;
+        fclose(file);
+
+        size_t size = set_size(&s);
+        printf("%s,%.2f,%.1f,%.1f,%.1f\n", dense ? "dense" : "random",
+               (double)bytes / size, size / write / 1e6, size / read / 1e6,
+               size / insert / 1e6);
+        set_free(&s);
+        set_free(&copy);
+    }
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,392 @@
+/* Standard workloads over a sweep of set shapes, for comparing changes to the
+ * library. Each row of output is one workload on one set shape:
+ *   - insert_seq, insert_random, insert_zipf: n inserts of increasing keys,
+ *     of distinct keys in random order, or of keys drawn from a Zipfian
+ *     distribution (s = 0.99) over n keys, so popular keys repeat.
+ *   - lookup_hit, lookup_miss: lookups of random keys which are, or are not,
+ *     in a set of n random keys.
+ *   - scan: set_map over a set of n random keys; an op is one element.
+ *   - mixed: on a set of n random keys, 80% lookups, 10% inserts and 10%
+ *     erases of random keys, half of them present.
+ * Lookup and mixed workloads run at least 10^6 ops; set-up is not timed.
+ * Sets are generic sets of `elem_size` byte elements (the key in the first 4
+ * or 8 bytes, zeros after), and for 4 and 8 bytes also the typed u32 and u64
+ * sets. Columns: ns per op; node allocations and bytes allocated during the
+ * timed part; and peak resident set size during the row (reset before each
+ * row where Linux allows, otherwise the peak of the process so far).
+ *
+ * Build: cc -O2 -D_POSIX_C_SOURCE=200809L -I.. suite.c ../set.c -pthread -lm \
+ *            -o suite
+ * Usage: ./suite [--json] [--max-n N] [--orders 4,8,...] [--sizes 4,8,...]
+ *                [--workloads insert_seq,scan,...] [--seed S]
+ * n runs over powers of 10 from 10^3 to max-n (default 10^6; up to 10^8).
+ */
+#include "../set.h"
+#include "bench.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#define SUITE_MAX_ELEM 64
+#define SUITE_MIN_OPS 1000000
+
+// allocator counting what the set allocates, around malloc
+typedef struct suite_counts {
+    size_t allocs;
+    size_t bytes;
+} suite_counts;
+
+static void *suite_alloc(void *ctx, size_t size) {
+    suite_counts *counts = ctx;
+    ++counts->allocs;
+    counts->bytes += size;
+    return malloc(size);
+}
+
+static void suite_free(void *ctx, void *ptr, size_t size) {
+    (void)ctx;
+    (void)size;
+    free(ptr);
+}
+
+// set_map callback for the scan workload
+static void suite_visit(void *elem, void *extra) {
+    *(size_t *)extra += *(unsigned char *)elem;
+}
+
+static bool suite_less_u32(void *x, void *y) {
+    return *(uint32_t *)x < *(uint32_t *)y;
+}
+
+// one set shape
+typedef struct suite_shape {
+    unsigned order;
+    size_t elem_size;
+    bool typed;
+} suite_shape;
+
+// key number `i` of a shape: a bijection of `i`, so distinct for distinct
+// `i`, scattered unless `sequential`
+static uint64_t suite_key(const suite_shape *shape, uint64_t i,
+                          bool sequential) {
+    if (shape->elem_size < 8) {
+        return sequential ? (uint32_t)i : (uint32_t)(i * 0x9E3779B1u);
+    }
+    return sequential ? i : i * UINT64_C(0x9E3779B97F4A7C15);
+}
+
+// store key `key` in the element at `elem`
+static void suite_elem(const suite_shape *shape, void *elem, uint64_t key) {
+    memset(elem, 0, shape->elem_size);
+    if (shape->elem_size < 8) {
+        uint32_t key32 = (uint32_t)key;
+        memcpy(elem, &key32, sizeof(key32));
+    }
+    else {
+        memcpy(elem, &key, sizeof(key));
+    }
+}
+
+static void suite_init(set *s, const suite_shape *shape, suite_counts *counts) {
+    if (shape->typed && shape->elem_size == 4) {
+        set_u32_init(s, shape->order);
+    }
+    else if (shape->typed) {
+        set_u64_init(s, shape->order);
+    }
+    else {
+        set_init(s, shape->order, shape->elem_size < 8 ? suite_less_u32
+                                                       : bench_less_u64,
+                 shape->elem_size);
+    }
+    set_allocator allocator = {suite_alloc, suite_free, NULL, counts};
+    set_set_allocator(s, &allocator);
+}
+
+// set `s` to hold keys 0 to n - 1 of `shape`
+static void suite_fill(set *s, const suite_shape *shape, size_t n) {
+    char elem[SUITE_MAX_ELEM];
+    for (size_t i = 0; i < n; ++i) {
+        suite_elem(shape, elem, suite_key(shape, i, false));
+        set_insert(s, elem);
+    }
+}
+
+// Zipfian ranks in [0, n), with exponent theta, by the method of Gray et al.,
+// "Quickly generating billion-record synthetic databases" (1994)
+typedef struct suite_zipf {
+    size_t n;
+    double theta, alpha, zetan, eta;
+    uint64_t seed;
+} suite_zipf;
+
+static void suite_zipf_init(suite_zipf *z, size_t n, double theta,
+                            uint64_t seed) {
+    double zeta2 = 1 + pow(0.5, theta);
+    z->n = n;
+    z->theta = theta;
+    z->zetan = 0;
+    for (size_t i = 1; i <= n; ++i) {
+        z->zetan += pow((double)i, -theta);
+    }
+    z->alpha = 1 / (1 - theta);
+    z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / z->zetan);
+    z->seed = seed;
+}
+
+static size_t suite_zipf_next(suite_zipf *z) {
+    double u = (bench_rand(&z->seed) >> 11) * 0x1p-53;
+    double uz = u * z->zetan;
+    if (uz < 1) {
+        return 0;
+    }
+    if (uz < 1 + pow(0.5, z->theta)) {
+        return z->n > 1;
+    }
+    size_t rank = (size_t)(z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+    return rank < z->n ? rank : z->n - 1;
+}
+
+typedef struct suite_row {
+    const char *workload;
+    suite_shape shape;
+    size_t n;
+    size_t ops;
+    double seconds;
+    suite_counts counts; // during the timed part
+    long peak_rss_kb;
+} suite_row;
+
+// Run workload `row->workload` on a new set, filling in the results
+static void suite_run(suite_row *row, uint64_t seed) {
+    const suite_shape *shape = &row->shape;
+    const char *name = row->workload;
+    size_t n = row->n;
+    suite_counts counts = {0, 0};
+    char elem[SUITE_MAX_ELEM];
+    set s;
+    suite_init(&s, shape, &counts);
+    size_t ops = n > SUITE_MIN_OPS ? n : SUITE_MIN_OPS;
+    size_t sink = 0;
+    double start = 0;
+    if (!strncmp(name, "insert_", 7)) {
+        bool sequential = !strcmp(name, "insert_seq");
+        bool zipf = !strcmp(name, "insert_zipf");
+        suite_zipf z = {0};
+        if (zipf) {
+            suite_zipf_init(&z, n, 0.99, seed);
+        }
+        ops = n;
+        start = bench_now();
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t key = suite_key(shape, zipf ? suite_zipf_next(&z) : i,
+                                     sequential);
+            suite_elem(shape, elem, key);
+            set_insert(&s, elem);
+        }
+    }
+    else if (!strncmp(name, "lookup_", 7)) {
+        // misses use the keys after the n in the set
+        size_t offset = !strcmp(name, "lookup_miss") ? n : 0;
+        suite_fill(&s, shape, n);
+        counts = (suite_counts){0, 0};
+        start = bench_now();
+        for (size_t i = 0; i < ops; ++i) {
+            uint64_t key = suite_key(shape, offset + bench_rand(&seed) % n,
+                                     false);
+            suite_elem(shape, elem, key);
+            sink += set_contains(&s, elem, NULL);
+        }
+    }
+    else if (!strcmp(name, "scan")) {
+        suite_fill(&s, shape, n);
+        counts = (suite_counts){0, 0};
+        ops = n;
+        start = bench_now();
+        set_map(&s, suite_visit, &sink);
+    }
+    else { // mixed
+        suite_fill(&s, shape, n);
+        counts = (suite_counts){0, 0};
+        start = bench_now();
+        for (size_t i = 0; i < ops; ++i) {
+            uint64_t r = bench_rand(&seed);
+            uint64_t key = suite_key(shape, (r >> 8) % (2 * n), false);
+            suite_elem(shape, elem, key);
+            if (r % 10 < 8) {
+                sink += set_contains(&s, elem, NULL);
+            }
+            else if (r % 10 == 8) {
+                set_insert(&s, elem);
+            }
+            else {
+                sink += set_erase(&s, elem, NULL);
+            }
+        }
+    }
+    row->seconds = bench_now() - start;
+    row->ops = ops;
+    row->counts = counts;
+    set_free(&s);
+    if (sink == (size_t)-1) { // keep the lookups from being optimized away
+        fputc('\n', stderr);
+    }
+}
+
+// reset the peak RSS of the process to its current RSS, if Linux allows
+static void suite_reset_peak_rss(void) {
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (f) {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+static long suite_peak_rss_kb(void) {
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = -1;
+    while (f && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    if (kb < 0) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        kb = usage.ru_maxrss;
+    }
+    return kb;
+}
+
+// parse a comma-separated list of numbers into `values`, returning how many
+static size_t suite_parse_list(const char *arg, unsigned *values, size_t max) {
+    size_t n = 0;
+    while (n < max) {
+        char *end;
+        unsigned long value = strtoul(arg, &end, 10);
+        if (end == arg) {
+            break;
+        }
+        values[n++] = value;
+        arg = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+int main(int argc, char **argv) {
+    static const char *all_workloads[] = {
+        "insert_seq", "insert_random", "insert_zipf", "lookup_hit",
+        "lookup_miss", "scan", "mixed",
+    };
+    size_t n_all = sizeof(all_workloads) / sizeof(all_workloads[0]);
+    unsigned orders[16] = {4, 8, 16, 32, 64, 128, 256};
+    size_t n_orders = 7;
+    unsigned sizes[16] = {4, 8, 16, 32, 64};
+    size_t n_sizes = 5;
+    const char *workloads = NULL;
+    size_t max_n = 1000000;
+    uint64_t seed = 1;
+    bool json = false;
+    for (int i = 1; i < argc; ++i) {
+        const char *value = i + 1 < argc ? argv[i + 1] : "";
+        if (!strcmp(argv[i], "--json")) {
+            json = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--max-n")) {
+            max_n = strtoull(value, NULL, 10);
+        }
+        else if (!strcmp(argv[i], "--orders")) {
+            n_orders = suite_parse_list(value, orders, 16);
+        }
+        else if (!strcmp(argv[i], "--sizes")) {
+            n_sizes = suite_parse_list(value, sizes, 16);
+        }
+        else if (!strcmp(argv[i], "--workloads")) {
+            workloads = value;
+        }
+        else if (!strcmp(argv[i], "--seed")) {
+            seed = strtoull(value, NULL, 10);
+        }
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+        ++i;
+    }
+    for (size_t i = 0; i < n_orders; ++i) {
+        if (orders[i] < 3 || orders[i] > UINT16_MAX) {
+            fprintf(stderr, "order %u out of range\n", orders[i]);
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < n_sizes; ++i) {
+        if (sizes[i] < 4 || sizes[i] > SUITE_MAX_ELEM) {
+            fprintf(stderr, "element size %u out of range\n", sizes[i]);
+            return 1;
+        }
+    }
+
+    if (json) {
+        printf("[\n");
+    }
+    else {
+        printf("workload,set,order,elem_size,n,ops,ns_per_op,allocs,"
+               "alloc_bytes,peak_rss_kb\n");
+    }
+    bool first = true;
+    for (size_t w = 0; w < n_all; ++w) {
+        const char *name = all_workloads[w];
+        if (workloads && !strstr(workloads, name)) {
+            continue;
+        }
+        for (size_t n = 1000; n <= max_n; n *= 10) {
+            for (size_t e = 0; e < n_sizes; ++e) {
+                for (int typed = 0; typed < 2; ++typed) {
+                    if (typed && sizes[e] != 4 && sizes[e] != 8) {
+                        continue;
+                    }
+                    for (size_t o = 0; o < n_orders; ++o) {
+                        suite_row row = {name, {orders[o], sizes[e], typed},
+                                         n, 0, 0, {0, 0}, 0};
+                        suite_reset_peak_rss();
+                        suite_run(&row, seed);
+                        row.peak_rss_kb = suite_peak_rss_kb();
+                        const char *kind = !typed ? "generic"
+                                           : sizes[e] == 4 ? "u32" : "u64";
+                        double ns = row.seconds * 1e9 / row.ops;
+                        if (json) {
+                            printf("%s  {\"workload\": \"%s\", \"set\": \"%s\", "
+                                   "\"order\": %u, \"elem_size\": %u, "
+                                   "\"n\": %zu, \"ops\": %zu, "
+                                   "\"ns_per_op\": %.2f, \"allocs\": %zu, "
+                                   "\"alloc_bytes\": %zu, "
+                                   "\"peak_rss_kb\": %ld}",
+                                   first ? "" : ",\n", name, kind, orders[o],
+                                   sizes[e], n, row.ops, ns,
+                                   row.counts.allocs, row.counts.bytes,
+                                   row.peak_rss_kb);
+                        }
+                        else {
+                            printf("%s,%s,%u,%u,%zu,%zu,%.2f,%zu,%zu,%ld\n",
+                                   name, kind, orders[o], sizes[e], n,
+                                   row.ops, ns, row.counts.allocs,
+                                   row.counts.bytes, row.peak_rss_kb);
+                        }
+                        first = false;
+                        fflush(stdout);
+                    }
+                }
+            }
+        }
+    }
+    if (json) {
+        printf("\n]\n");
+    }
+    return 0;
+}
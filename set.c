@@ -1,258 +1,3360 @@
 #include "set.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-/* Set, implemented as B tree. See https://en.wikipedia.org/wiki/B-tree
+#if defined(__GNUC__)
+#define SET_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define SET_PREFETCH(addr) ((void)(addr))
+#endif
+
+// Add `n` to counter `counter` of the stats of set `s`, if instrumented. The
+// counters are plain integers, so increments from concurrent threads may be
+// lost; that keeps them cheap enough to leave in hot loops.
+#ifdef SET_STATS
+#define SET_COUNT(s, counter, n) ((s)->stats.counter += (n))
+#else
+#define SET_COUNT(s, counter, n) ((void)0)
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SET_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define SET_X86_SIMD 0
+#endif
+
+/* Set, implemented as B+ tree. See https://en.wikipedia.org/wiki/B%2B_tree
+ * All elements are stored in leaves. Internal nodes store, as separators, a
+ * copy of the first element under each of their children but the first, so
+ * an element equivalent to separator `i` is found under child `i + 1`.
  */
 
-/* Ownership: upon free, a `set_node` is liable for freeing its children and
- * its data
+/* Ownership: upon free, a `set_node` is liable for freeing its children.
+ * Layout: every node is a single allocation. The header below is followed by
+ * `order - 1` key slots at `set.keys_offset`, then the high key slot, and, for
+ * internal nodes only, `order` child pointers at `set.children_offset`. See
+ * `set_init`.
+ * High keys: a node with a right sibling stores, as its high key, the
+ * separator between the two in their lowest common ancestor. Every element
+ * under the node is less than it, and every element under the sibling is not.
+ * Concurrent descents compare against it to notice a node was split after
+ * they read its parent, and follow `right_sibling` to the new node (as in a
+ * Lehman-Yao B-link tree).
  */
 // TODO: make const correct
 typedef struct set_node {
-    set *home_set; // pointer to the set that this is a part of
-    uintptr_t data; // pointer to data
     struct set_node *parent;
-    struct set_node *right_sibling;
-    struct set_node **children; //NULL if leaf
-    uint8_t n_keys; // number of keys stored in the node. Max = tree order - 1.
-                    // Number of children = number of keys + 1
+    struct set_node *right_sibling; // next node on the same level, or NULL.
+                                    // For leaves, this chains all elements
+                                    // in order
+    uint16_t n_keys; // number of keys stored in the node. Max = tree order - 1.
+                     // Number of children = number of keys + 1
+                     // Non-root nodes hold at least order / 2 keys (leaves)
+                     // or (order + 1) / 2 children (internal nodes)
+    bool is_leaf;
+    _Atomic uint32_t version; // even while the node is stable, odd while a
+                              // writer changes it. See set_contains_shared
+    _Atomic uint32_t refs; // number of trees (a set and its snapshots)
+                           // sharing this node. See set_snapshot
 } set_node;
 
-struct set {
-    size_t elem_size;
-    set_less_t less;
-    set_node* root;
-    uint8_t order; // Knuth order of tree. Equal to max number of children
-};
+// pointer to key `index` of `node`
+static inline void *set_node_key(const set *s, set_node *node, size_t index) {
+    return (void *)((uintptr_t)node + s->keys_offset + index * s->elem_size);
+}
+
+// pointer to the high key of `node`. Only valid if `node` has a right sibling
+static inline void *set_node_high_key(const set *s, set_node *node) {
+    return set_node_key(s, node, s->order - 1);
+}
+
+// pointer to the child array of `node`. Only valid if `node` is not a leaf
+static inline set_node **set_node_children(const set *s, set_node *node) {
+    return (set_node **)((uintptr_t)node + s->children_offset);
+}
+
+// child `index` of internal node `node`. The nodes of an image link to each
+// other by offsets from its start (see set_image_open), and `s->image` is 0
+// for any other set, so following a child costs an add but no branch
+static inline set_node *set_node_child(const set *s, set_node *node,
+                                       size_t index) {
+    return (set_node *)(s->image
+                        + (uintptr_t)set_node_children(s, node)[index]);
+}
+
+// right sibling of `node`, or NULL
+static inline set_node *set_node_next(const set *s, set_node *node) {
+    set_node *next = node->right_sibling;
+    return next ? (set_node *)(s->image + (uintptr_t)next) : NULL;
+}
+
+// whether `x` is less than `y` by the `less` or `cmp` of `s`. Every call of
+// either goes through here or `set_compare`, so instrumented sets can count
+// them.
+static inline bool set_less(set *s, const void *x, const void *y) {
+    SET_COUNT(s, less_calls, 1);
+    if (s->cmp) {
+        return s->cmp(x, y, s->cmp_ctx) < 0;
+    }
+    return s->less((void *)x, (void *)y);
+}
+
+// negative, zero or positive as `x` is less than, equivalent to or greater
+// than `y`. One call of `cmp`, or one or two of `less`
+static inline int set_compare(set *s, const void *x, const void *y) {
+    if (s->cmp) {
+        SET_COUNT(s, less_calls, 1);
+        return s->cmp(x, y, s->cmp_ctx);
+    }
+    if (set_less(s, x, y)) {
+        return -1;
+    }
+    return set_less(s, y, x);
+}
+
+// pointer to the subtree sizes of the children of `node`, parallel to its
+// child array. Only valid if `node` is not a leaf and `s` tracks ranks
+static inline size_t *set_node_counts(const set *s, set_node *node) {
+    return (size_t *)((uintptr_t)node + s->counts_offset);
+}
+
+// number of elements in the subtree rooted at `node`. Only valid if `node` is
+// a leaf or `s` tracks ranks
+static inline size_t set_subtree_size(const set *s, set_node *node) {
+    if (node->is_leaf) {
+        return node->n_keys;
+    }
+    size_t *counts = set_node_counts(s, node);
+    size_t size = 0;
+    for (size_t child = 0; child < (size_t)node->n_keys + 1; ++child) {
+        size += counts[child];
+    }
+    return size;
+}
+
+// Make `child` child `index` of internal `node`, recording its size if `s`
+// tracks ranks
+static inline void set_put_child(set *s, set_node *node, size_t index,
+                                 set_node *child) {
+    set_node_children(s, node)[index] = child;
+    child->parent = node;
+    if (s->counts_offset) {
+        set_node_counts(s, node)[index] = set_subtree_size(s, child);
+    }
+}
+
+// Move `n` children of `src`, starting at index `src_index`, to index
+// `dst_index` of `dst`, along with their sizes if `s` tracks ranks. The
+// ranges may overlap. Parent pointers are left to the caller.
+static inline void set_move_children(set *s, set_node *dst, size_t dst_index,
+                                     set_node *src, size_t src_index,
+                                     size_t n) {
+    memmove(set_node_children(s, dst) + dst_index,
+            set_node_children(s, src) + src_index, n * sizeof(set_node *));
+    if (s->counts_offset) {
+        memmove(set_node_counts(s, dst) + dst_index,
+                set_node_counts(s, src) + src_index, n * sizeof(size_t));
+    }
+}
+
+// Deepest a tree can get: every internal node has at least two children
+#define SET_MAX_DEPTH 64
+
+// If `s` tracks ranks, add `delta` to the sizes recorded on the way from the
+// root down to `leaf`, which took child `path[i]` at depth `i`
+static void set_count_path(set *s, set_node *leaf, const size_t *path,
+                           size_t depth, size_t delta) {
+    if (!s->counts_offset) {
+        return;
+    }
+    set_node *node = leaf->parent;
+    while (depth--) {
+        set_node_counts(s, node)[path[depth]] += delta;
+        node = node->parent;
+    }
+}
+
+// index of `child` among the children of `parent`
+static size_t set_child_index(set *s, set_node *parent, set_node *child) {
+    set_node **children = set_node_children(s, parent);
+    size_t index = 0;
+    while (children[index] != child) {
+        ++index;
+    }
+    return index;
+}
+
+// If `s` tracks ranks, add `delta` to the sizes recorded for `node` and each
+// of its ancestors in their parents
+static void set_count_ancestors(set *s, set_node *node, size_t delta) {
+    if (!s->counts_offset) {
+        return;
+    }
+    for (; node->parent; node = node->parent) {
+        set_node_counts(s, node->parent)[set_child_index(s, node->parent,
+                                                         node)] += delta;
+    }
+}
+
+// round `size` up to a multiple of `align`, which must be a power of 2
+static size_t set_align_up(size_t size, size_t align) {
+    return (size + align - 1) & ~(align - 1);
+}
+
+// bytes malloc gives a node of `size` bytes of `s`: whole multiples of
+// `node_align`, which aligned_alloc requires
+static inline size_t set_node_alloc_size(const set *s, size_t size) {
+    return s->node_align ? set_align_up(size, s->node_align) : size;
+}
+
+// allocate `size` bytes for a node of `s`
+static inline void *set_alloc(set *s, size_t size) {
+    SET_COUNT(s, allocs, 1);
+    SET_COUNT(s, alloc_bytes, size);
+    if (s->allocator.alloc) {
+        return s->allocator.alloc(s->allocator.ctx, size);
+    }
+    if (s->node_align) {
+        return aligned_alloc(s->node_align, set_node_alloc_size(s, size));
+    }
+    return malloc(size);
+}
+
+// release `node`, which must have been allocated for `s`
+static inline void set_node_release(set *s, set_node *node) {
+    SET_COUNT(s, frees, 1);
+    if (s->allocator.free) {
+        s->allocator.free(s->allocator.ctx, node,
+                          node->is_leaf ? s->leaf_size : s->node_size);
+    }
+    else if (!s->allocator.alloc) {
+        free(node);
+    }
+}
 
-/* Sets home_set, parent, n_keys, and allocates space for data. If not leaf,
- * also allocates space for children. Otherwise sets chilren to NULL
+/* Allocates a node with room for `order - 1` keys, and `order` children if not
+ * leaf, and sets parent, right_sibling, n_keys and is_leaf. Returns NULL if
+ * the allocation fails.
  * NOTES:
- *   - data remains unititialized.
- *   - children, if not NULL, remains unititialized.
+ *   - keys remain unititialized.
+ *   - children, if any, remain unititialized.
  */
-void set_node_init(set_node *node, set *home_set, set_node* parent,
-                   set_node* right_sibling, size_t n_keys, bool is_leaf) {
-    uint8_t order = home_set->order;
-    node->home_set = home_set;
-    node->data = (uintptr_t)calloc(order - 1, home_set->elem_size);
-    node->children = is_leaf ? NULL : calloc(order, home_set -> elem_size);
+set_node *set_node_init(set *home_set, set_node* parent,
+                        set_node* right_sibling, size_t n_keys, bool is_leaf) {
+    set_node *node = set_alloc(home_set, is_leaf ? home_set->leaf_size
+                                                 : home_set->node_size);
+    if (!node) {
+        return NULL;
+    }
     node->parent = parent;
     node->right_sibling = right_sibling;
     node->n_keys = n_keys;
+    node->is_leaf = is_leaf;
+    atomic_init(&node->version, 0);
+    atomic_init(&node->refs, 1);
+    return node;
+}
+
+/* Optimistic lock coupling. The one writer brackets every change to a node
+ * that readers may be looking at with `set_node_write_begin` and
+ * `set_node_write_end`, making its version odd for the duration. Readers take
+ * no locks: they note a node's version, read the node, and then check the
+ * version is unchanged, retrying if not. Reads of a node may therefore race
+ * with writes to it, but their results are only used once validated, as in a
+ * seqlock. Nodes are never freed by inserts, so a stale pointer read from a
+ * node being changed still points to a node.
+ */
+static inline void set_node_write_begin(set_node *node) {
+    uint32_t version = atomic_load_explicit(&node->version,
+                                            memory_order_relaxed);
+    atomic_store_explicit(&node->version, version + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void set_node_write_end(set_node *node) {
+    uint32_t version = atomic_load_explicit(&node->version,
+                                            memory_order_relaxed);
+    atomic_store_explicit(&node->version, version + 1, memory_order_release);
+}
+
+// Take the write lock of `node`, for writers which race with each other. To
+// readers this looks the same as `set_node_write_begin`, and
+// `set_node_write_end` releases it.
+static inline void set_node_lock(set_node *node) {
+    uint32_t version = atomic_load_explicit(&node->version,
+                                            memory_order_relaxed);
+    while ((version & 1)
+           || !atomic_compare_exchange_weak_explicit(&node->version, &version,
+                                                     version + 1,
+                                                     memory_order_acquire,
+                                                     memory_order_relaxed)) {
+        if (version & 1) {
+            version = atomic_load_explicit(&node->version,
+                                           memory_order_relaxed);
+        }
+    }
+    atomic_thread_fence(memory_order_release);
+}
+
+// wait until no writer is changing `node`, and return its version
+static inline uint32_t set_node_read_begin(set_node *node) {
+    uint32_t version;
+    while ((version = atomic_load_explicit(&node->version,
+                                           memory_order_acquire)) & 1) {
+    }
+    return version;
+}
+
+// whether `node` is unchanged since `set_node_read_begin` returned `version`
+static inline bool set_node_read_valid(set_node *node, uint32_t version) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&node->version, memory_order_relaxed)
+           == version;
+}
+
+// The root pointer is published with release and read with acquire, so that
+// readers see a new root's contents. `set.root` is a plain pointer so that
+// set.h needs no atomics; every other access to it is by the writer.
+static inline set_node *set_root_load(set *s) {
+    return atomic_load_explicit((_Atomic(set_node *) *)&s->root,
+                                memory_order_acquire);
+}
+
+static inline void set_root_store(set *s, set_node *root) {
+    atomic_store_explicit((_Atomic(set_node *) *)&s->root, root,
+                          memory_order_release);
+}
+
+// floor(log2(value)), for value > 0
+static inline size_t set_log2(uint64_t value) {
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(value);
+#else
+    size_t log = 0;
+    while (value >>= 1) {
+        ++log;
+    }
+    return log;
+#endif
+}
+
+/* Latency histograms are log-linear, as in HdrHistogram: values below 16 ns
+ * have a bucket each, and each power of 2 above is split into 8 buckets, so a
+ * bucket spans at most 1/8 of the values in it. Value `v` goes in bucket
+ * `8 shift + (v >> shift)`, where `shift` drops all but 4 significant bits.
+ */
+#define SET_LATENCY_SUB_BUCKETS 8
+
+// largest value in bucket `bucket`
+static uint64_t set_latency_bucket_max(size_t bucket) {
+    size_t shift = bucket < 2 * SET_LATENCY_SUB_BUCKETS
+                   ? 0 : bucket / SET_LATENCY_SUB_BUCKETS - 1;
+    uint64_t mantissa = bucket - shift * SET_LATENCY_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+#ifdef SET_STATS
+static size_t set_latency_shift(uint64_t ns) {
+    size_t log = ns ? set_log2(ns) : 0;
+    return log > 3 ? log - 3 : 0;
+}
+
+static uint64_t set_stats_now(void) {
+    struct timespec now;
+#if defined(CLOCK_MONOTONIC)
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#else
+    timespec_get(&now, TIME_UTC);
+#endif
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void set_latency_record(set_latency *latency, uint64_t ns) {
+    size_t shift = set_latency_shift(ns);
+    ++latency->buckets[shift * SET_LATENCY_SUB_BUCKETS + (ns >> shift)];
+    ++latency->count;
+    latency->total_ns += ns;
+    if (ns > latency->max_ns) {
+        latency->max_ns = ns;
+    }
+}
+#endif
+
+/* SIMD counting of keys below a probe, for the typed sets. Keys are sorted, so
+ * the count is the index `set_node_search` looks for. Each vector compare
+ * tests several keys at once, and the count is the popcount of the resulting
+ * mask. Unsigned keys are handled with signed compares by xoring both sides
+ * with `flip`, the sign bit. SSE2 has no 64 bit compare, and emulating one
+ * with 32 bit compares measured slower than the scalar count, so 64 bit keys
+ * only use AVX2. Functions are compiled for their instruction set
+ * with target attributes, and chosen at run time from `set.simd`, so one
+ * binary runs on any x86-64 host.
+ */
+#if SET_X86_SIMD
+// popcount of a mask of at most 4 bits. Plain SSE2 hosts may lack the popcnt
+// instruction, and __builtin_popcount would then be a library call
+static inline size_t set_popcount4(int mask) {
+    return (0x4332322132212110ULL >> (mask * 4)) & 0xF;
+}
+
+static size_t set_sse2_count_less_32(const int32_t *keys, size_t n_keys,
+                                     int32_t probe, int32_t flip) {
+    __m128i vflip = _mm_set1_epi32(flip);
+    __m128i vprobe = _mm_set1_epi32(probe ^ flip);
+    size_t count = 0;
+    size_t key = 0;
+    for (; key + 4 <= n_keys; key += 4) {
+        __m128i vkeys = _mm_xor_si128(
+                _mm_loadu_si128((const __m128i *)(keys + key)), vflip);
+        int mask = _mm_movemask_ps(
+                _mm_castsi128_ps(_mm_cmpgt_epi32(vprobe, vkeys)));
+        count += set_popcount4(mask);
+    }
+    for (; key < n_keys; ++key) {
+        count += (keys[key] ^ flip) < (probe ^ flip);
+    }
+    return count;
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t set_avx2_count_less_32(const int32_t *keys, size_t n_keys,
+                                     int32_t probe, int32_t flip) {
+    __m256i vflip = _mm256_set1_epi32(flip);
+    __m256i vprobe = _mm256_set1_epi32(probe ^ flip);
+    size_t count = 0;
+    size_t key = 0;
+    for (; key + 8 <= n_keys; key += 8) {
+        __m256i vkeys = _mm256_xor_si256(
+                _mm256_loadu_si256((const __m256i *)(keys + key)), vflip);
+        int mask = _mm256_movemask_ps(
+                _mm256_castsi256_ps(_mm256_cmpgt_epi32(vprobe, vkeys)));
+        count += __builtin_popcount(mask);
+    }
+    for (; key < n_keys; ++key) {
+        count += (keys[key] ^ flip) < (probe ^ flip);
+    }
+    return count;
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t set_avx2_count_less_64(const int64_t *keys, size_t n_keys,
+                                     int64_t probe, int64_t flip) {
+    __m256i vflip = _mm256_set1_epi64x(flip);
+    __m256i vprobe = _mm256_set1_epi64x(probe ^ flip);
+    size_t count = 0;
+    size_t key = 0;
+    for (; key + 4 <= n_keys; key += 4) {
+        __m256i vkeys = _mm256_xor_si256(
+                _mm256_loadu_si256((const __m256i *)(keys + key)), vflip);
+        int mask = _mm256_movemask_pd(
+                _mm256_castsi256_pd(_mm256_cmpgt_epi64(vprobe, vkeys)));
+        count += __builtin_popcount(mask);
+    }
+    for (; key < n_keys; ++key) {
+        count += (keys[key] ^ flip) < (probe ^ flip);
+    }
+    return count;
+}
+#endif
+
+// best vector instruction set the CPU supports
+static uint8_t set_detect_simd(void) {
+#if SET_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        return SET_SIMD_AVX2;
+    }
+    return SET_SIMD_SSE2;
+#else
+    return SET_SIMD_NONE;
+#endif
+}
+
+// Count keys less than `probe` using instruction set `simd`, which must not be
+// SET_SIMD_NONE
+static size_t set_simd_count_less_32(uint8_t simd, const void *keys,
+        size_t n_keys, int32_t probe, int32_t flip) {
+#if SET_X86_SIMD
+    if (simd == SET_SIMD_AVX2) {
+        return set_avx2_count_less_32(keys, n_keys, probe, flip);
+    }
+    return set_sse2_count_less_32(keys, n_keys, probe, flip);
+#else
+    (void)simd; (void)keys; (void)n_keys; (void)probe; (void)flip;
+    abort();
+#endif
+}
+
+static size_t set_simd_count_less_64(uint8_t simd, const void *keys,
+        size_t n_keys, int64_t probe, int64_t flip) {
+#if SET_X86_SIMD
+    if (simd == SET_SIMD_AVX2) {
+        return set_avx2_count_less_64(keys, n_keys, probe, flip);
+    }
+#else
+    (void)simd;
+#endif
+    const int64_t *keys64 = keys;
+    size_t count = 0;
+    for (size_t key = 0; key < n_keys; ++key) {
+        count += (keys64[key] ^ flip) < (probe ^ flip);
+    }
+    return count;
+}
+
+// Offset of the first key of a node holding elements of `elem_size` bytes.
+// Keys are laid out like an array of the element type, so they need the
+// largest power of 2 dividing `elem_size` as alignment (capped to the
+// strictest alignment malloc guarantees).
+static size_t set_keys_offset(size_t elem_size) {
+    size_t key_align = elem_size & -elem_size;
+    if (key_align == 0 || key_align > _Alignof(max_align_t)) {
+        key_align = _Alignof(max_align_t);
+    }
+    return set_align_up(sizeof(set_node), key_align);
+}
+
+// footprint in bytes of `target`
+static size_t set_target_bytes(enum set_node_target target) {
+    return target == SET_TARGET_LINE ? SET_CACHE_LINE
+           : target == SET_TARGET_L2 ? SET_L2_NODE_BYTES
+           : SET_PAGE_BYTES;
+}
+
+uint16_t set_auto_order(size_t elem_size, enum set_node_target target) {
+    size_t bytes = set_target_bytes(target);
+    // a leaf is its header and `order` key slots, the last for the high key.
+    // Internal nodes have the same, followed by their children
+    size_t header = set_keys_offset(elem_size);
+    size_t order = bytes > header ? (bytes - header) / elem_size : 0;
+    if (order < 3) {
+        return 3;
+    }
+    return order > UINT16_MAX ? UINT16_MAX : order;
+}
+
+// Have malloc'd nodes of `s` start on boundaries of the footprint of
+// `target`, if that is a power of 2 bigger than malloc's own alignment
+static void set_align_nodes(set *s, enum set_node_target target) {
+    size_t bytes = set_target_bytes(target);
+    if ((bytes & (bytes - 1)) == 0 && bytes > _Alignof(max_align_t)) {
+        s->node_align = bytes;
+    }
+}
+
+uint16_t set_init_auto(set *s, set_less_t less, size_t elem_size,
+                       enum set_node_target target) {
+    uint16_t order = set_auto_order(elem_size, target);
+    set_init(s, order, less, elem_size);
+    set_align_nodes(s, target);
+    return order;
 }
 
-void set_init(set *s, uint8_t order, set_less_t less, size_t elem_size) {
+void set_init(set *s, uint16_t order, set_less_t less, size_t elem_size) {
     s->elem_size = elem_size;
     s->less = less;
+    s->cmp = NULL;
+    s->cmp_ctx = NULL;
     s->root = NULL;
     s->order = order;
+    s->binary_search = order > SET_BINARY_SEARCH_ORDER;
+    s->key_kind = SET_KEY_GENERIC;
+    s->simd = set_detect_simd();
+    s->allocator = (set_allocator){0};
+    s->node_align = 0;
+    s->size = 0;
+    s->counts_offset = 0;
+    s->shares_nodes = false;
+    s->is_snapshot = false;
+    s->image = 0;
+    s->frozen = NULL;
+#ifdef SET_STATS
+    set_stats_reset(s);
+#endif
+    s->keys_offset = set_keys_offset(elem_size);
+    s->leaf_size = s->keys_offset + order * elem_size; // with the high key
+    s->children_offset = set_align_up(s->leaf_size, _Alignof(set_node *));
+    s->node_size = s->children_offset + order * sizeof(set_node *);
 }
 
-void set_tree_free(set_node *node) {
+void set_init_cmp(set *s, uint16_t order, set_cmp_t cmp, void *ctx,
+                  size_t elem_size) {
+    set_init(s, order, NULL, elem_size);
+    s->cmp = cmp;
+    s->cmp_ctx = ctx;
+}
+
+// Drop one reference to `node`. The last one frees it, dropping its references
+// to its children in turn.
+void set_tree_free(set *s, set_node *node) {
+    // a node nobody else shares cannot gain references, so needs no atomic
+    // decrement
+    if (atomic_load_explicit(&node->refs, memory_order_acquire) != 1
+        && atomic_fetch_sub_explicit(&node->refs, 1, memory_order_acq_rel)
+           != 1) {
+        return;
+    }
     // recursively free children
-    for (size_t child = 0; child < node->n_keys + 1; ++child) {
-        set_tree_free(node->children[child]);
+    if (!node->is_leaf) {
+        set_node **children = set_node_children(s, node);
+        for (size_t child = 0; child < (size_t)node->n_keys + 1; ++child) {
+            set_tree_free(s, children[child]);
+        }
     }
-    // free stored data
-    free((void *)node->data);
+    // keys live in the same allocation as the node
+    set_node_release(s, node);
 }
 
 void set_free(set *s) {
-    set_tree_free(s->root);
+    if (s->image) {
+        // the nodes belong to the image
+        s->image = 0;
+    }
+    else if (s->allocator.release) {
+        s->allocator.release(s->allocator.ctx);
+    }
+    else if (s->root) {
+        set_tree_free(s, s->root);
+    }
+    s->root = NULL;
+    s->size = 0;
+    s->shares_nodes = false;
+    free(s->frozen);
+    s->frozen = NULL;
 }
 
-bool set_tree_contains(set_node *node, void *elem, void *copy_out) {
-    // convenience definitions
-    size_t elem_size = node->home_set->elem_size;
-    set_less_t less = node->home_set->less;
-    // defs for searching
-    size_t elem_index = 0; // point where `elem` would go in data
-    void *stored = (void *)node->data; // pointer to stored data at `elem_index`
-    // move `elem_index` until at end or `stored` >= `elem`
-    while (elem_index < node->n_keys && less(stored, elem)) {
-        stored = (void *)(node->data + elem_index * elem_size);
-        ++elem_index;
+/* Snapshots. A snapshot is a copy of the `set` struct whose root holds one
+ * more reference, so taking one is O(1). Nodes with more than one reference
+ * are shared and read-only; a set about to change one first replaces it by a
+ * private copy, which means copying the path to it from the root. Children of
+ * a copy gain a reference each. The link fields (`parent` and
+ * `right_sibling`) of a shared node belong to the live set, which keeps them
+ * pointing at its own copies; snapshots only ever descend from their root.
+ */
+
+set *set_snapshot(set *s) {
+    if (s->allocator.release || s->image || s->frozen) {
+        return NULL;
     }
-    if (!less(elem, stored)) { // stored == elem; we've found it
-        if(copy_out) {
-            memcpy(copy_out, stored, elem_size);
-        }
-        return true;
+    set *snapshot = malloc(sizeof(set));
+    if (!snapshot) {
+        return NULL;
     }
-    if (!node->children) { // we are leaf, elem not found
-        return false;
+    *snapshot = *s;
+    snapshot->shares_nodes = true;
+    snapshot->is_snapshot = true;
+    if (s->root) {
+        atomic_fetch_add_explicit(&s->root->refs, 1, memory_order_relaxed);
+        if (!s->is_snapshot) {
+            s->shares_nodes = true;
+        }
     }
-    // recursive case; elem in children[elem_index]
-    return set_tree_contains(node->children[elem_index], elem, copy_out);
+    return snapshot;
 }
 
-bool set_contains(set *s, void *elem, void *copy_out) {
-    if (s->root) {
-        return set_tree_contains(s->root, elem, copy_out);
+// Replace child `index` of `parent` (or the root, if `parent` is NULL), which
+// is shared, by a private copy, and return the copy. `left` is the node left
+// of it on its level, or NULL. Returns NULL, changing nothing, if the copy
+// cannot be allocated.
+static set_node *set_unshare(set *s, set_node *parent, size_t index,
+                             set_node *left) {
+    set_node *node = parent ? set_node_children(s, parent)[index] : s->root;
+    size_t size = node->is_leaf ? s->leaf_size : s->node_size;
+    set_node *copy = set_alloc(s, size);
+    if (!copy) {
+        return NULL;
     }
-    else { // empty set
-        return false;
+    memcpy(copy, node, size);
+    atomic_init(&copy->version, 0);
+    atomic_init(&copy->refs, 1);
+    if (!node->is_leaf) {
+        set_node **children = set_node_children(s, copy);
+        for (size_t child = 0; child < (size_t)copy->n_keys + 1; ++child) {
+            atomic_fetch_add_explicit(&children[child]->refs, 1,
+                                      memory_order_relaxed);
+            children[child]->parent = copy;
+        }
+    }
+    if (parent) {
+        set_node_children(s, parent)[index] = copy;
     }
+    else {
+        s->root = copy;
+    }
+    if (left) {
+        left->right_sibling = copy;
+    }
+    set_tree_free(s, node); // the set's reference moves to the copy
+    return copy;
 }
 
-// forward declare insertion
-void set_insert_in_node(set_node* node, void *elem, size_t elem_size,
-        set_node *right_child, set_less_t less);
-
-// Simple insert case: node not full so just insert in current node
-void set_insert_in_node_simple(set_node* node, void *elem, size_t elem_size,
-        size_t elem_index, set_node *right_child, set_less_t less) {
-    ++node->n_keys;
-    uintptr_t elem_addr = node->data + elem_index * elem_size;
-    // move elements after target
-    memmove((void *)(elem_addr + elem_size), (void *)elem_addr,
-            (node->n_keys - elem_index) * elem_size);
-    memcpy((void *)elem_addr, elem, elem_size);
-    if (node->children) {
-        node->children[node->n_keys] = right_child;
+// The root of `s`, made private if shared, for callers about to descend and
+// change the tree. NULL if `s` is empty, or the copy cannot be allocated
+static inline set_node *set_private_root(set *s) {
+    set_node *root = s->root;
+    if (s->shares_nodes && root
+        && atomic_load_explicit(&root->refs, memory_order_relaxed) > 1) {
+        root = set_unshare(s, NULL, 0, NULL);
     }
+    return root;
 }
 
-// Complex insert case: split this node in two, and insert median value into
-// parent node. If the max number of keys is odd, left node will end up with
-// one more key than the right node. This reduces copying, and left-biases the
-// data (which is slightly faster since we are using less for querying)
-void set_insert_in_node_complex(set_node* node, void *elem, size_t elem_size,
-        size_t elem_index, set_node *right_child, set_less_t less) {
+// the node left of child `index` of `node` on its level, given the node
+// `left` of `node` on its own
+static inline set_node *set_left_of_child(set *s, set_node *node,
+                                          size_t index, set_node *left) {
+    if (index > 0) {
+        return set_node_children(s, node)[index - 1];
+    }
+    return left ? set_node_children(s, left)[left->n_keys] : NULL;
+}
 
-    size_t n_old = (node->n_keys - 1) / 2 + 1; // ceiling of max_keys / 2
-    size_t n_new = node->n_keys - n_old;
-    // pivot is first elem which gets moved to right node (left insert)
-    // or elem before first which gets moved to right node (right insert)
-    uintptr_t pivot_addr = node->data + n_old * elem_size;
-    // address where elem would appear in old array
-    uintptr_t elem_addr = node->data + elem_index * elem_size;
+// Child `index` of the private `node`, made private if shared, for descents
+// which will change the tree. `*left` is the node left of `node` on its
+// level, and becomes the one left of the child; it is only tracked while `s`
+// shares nodes. NULL if the copy cannot be allocated.
+static inline set_node *set_child_for_write(set *s, set_node *node,
+                                            size_t index, set_node **left) {
+    set_node *child = set_node_children(s, node)[index];
+    if (s->shares_nodes) {
+        *left = set_left_of_child(s, node, index, *left);
+        if (atomic_load_explicit(&child->refs, memory_order_relaxed) > 1) {
+            child = set_unshare(s, node, index, *left);
+        }
+    }
+    return child;
+}
 
-    // allocate new right node. Current node becomes left node
-    set_node *new_node = calloc(1, sizeof(set_node));
-    set_node_init(new_node, node->home_set, node->parent, n_new, false);
-
-    // copy data. Moved element ends up at pivot address
-    if (elem_index <= n_old) { // elem goes in left (old) half
-        // copy (pivot to end-of-data) to new node
-        memcpy((void *)new_node->data, (void *)pivot_addr, n_new * elem_size);
-        // memmove (elem_addr to pivot) forward one element
-        memmove((void *)elem_addr + 1, (void *)elem_addr,
-                pivot_addr - elem_addr);
-        // memcpy element into its place
-        memcpy((void *)elem_addr, elem, elem_size);
+// Make every node under the private `node` private. `lefts[depth]` holds the
+// last node reached so far on level `depth`, which is left of the next one.
+// Returns false if a copy cannot be allocated.
+static bool set_unshare_subtree(set *s, set_node *node, set_node **lefts,
+                                size_t depth) {
+    if (node->is_leaf) {
+        return true;
     }
-    else { // elem goes in right (new) half
-        uintptr_t insert_addr = new_node->data + (elem_index - n_old);
-        // copy (pivot + 1 to elem_addr) to new node
-        memcpy((void *)new_node->data, (void *)(pivot_addr + elem_size),
-                insert_addr - new_node->data);
-        // memcpy element to new node
-        memcpy((void *)insert_addr, elem, elem_size);
-        // memcpy (elem_addr to end of data) to new node
-        memcpy((void *)(insert_addr + elem_size), (void *)elem_addr,
-                (node->n_keys - elem_index) * elem_size);
+    set_node **children = set_node_children(s, node);
+    for (size_t index = 0; index < (size_t)node->n_keys + 1; ++index) {
+        set_node *child = children[index];
+        if (atomic_load_explicit(&child->refs, memory_order_relaxed) > 1) {
+            child = set_unshare(s, node, index, lefts[depth + 1]);
+            if (!child) {
+                return false;
+            }
+        }
+        lefts[depth + 1] = child;
+        if (!set_unshare_subtree(s, child, lefts, depth + 1)) {
+            return false;
+        }
     }
+    return true;
+}
 
-    // copy right-half children to new node
-    if (node->children) {
-        memcpy(new_node->children, node->children + n_old,
-                (n_new + 1) * elem_size);
+// Make every node of `s` private, so elements can be changed in place without
+// changing any snapshot. O(n) if `s` shares nodes, else O(1). Returns false
+// if a copy cannot be allocated; the nodes copied so far stay private.
+static bool set_unshare_all(set *s) {
+    if (!s->shares_nodes || s->is_snapshot) {
+        return true;
+    }
+    if (s->root) {
+        set_node *root = set_private_root(s);
+        set_node *lefts[SET_MAX_DEPTH] = {0};
+        if (!root || !set_unshare_subtree(s, root, lefts, 0)) {
+            return false;
+        }
     }
+    s->shares_nodes = false;
+    return true;
+}
 
-    // update n_keys
-    node->n_keys = n_old;
-    new_node->n_keys = n_new;
+void set_set_allocator(set *s, const set_allocator *allocator) {
+    s->allocator = *allocator;
+}
 
-    // insert pivot_elem into parent
-    if (node->parent) {
-        set_insert_in_node(node->parent, (void *)pivot_addr, elem_size,
-            new_node, less);
+/* Arena chunks are linked through a header at their start. Blocks are handed
+ * out from just after the header, rounded up to keep them max-aligned.
+ */
+typedef struct set_arena_chunk {
+    struct set_arena_chunk *next;
+} set_arena_chunk;
+
+#define SET_ARENA_DEFAULT_CHUNK ((size_t)64 << 10)
+#define SET_ARENA_MAX_CHUNK ((size_t)64 << 20)
+
+void set_arena_init(set_arena *arena, size_t chunk_size) {
+    memset(arena, 0, sizeof(*arena));
+    arena->min_chunk_size = chunk_size ? chunk_size : SET_ARENA_DEFAULT_CHUNK;
+    arena->chunk_size = arena->min_chunk_size;
+}
+
+void set_arena_free(set_arena *arena) {
+    set_arena_chunk *chunk = arena->chunks;
+    while (chunk) {
+        set_arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
     }
-    else { // this is the root
-        set_node* new_root = calloc(1, sizeof(set_node));
-        set_node_init(new_node, node->home_set, NULL, 1, false);
-        memcpy((void *)new_node->data, (void *)pivot_addr, elem_size);
-        new_root->children[0] = node;
-        new_root->children[1] = new_node;
+    set_arena_init(arena, arena->min_chunk_size);
+}
+
+static void *set_arena_alloc(void *ctx, size_t size) {
+    set_arena *arena = ctx;
+    size = set_align_up(size, _Alignof(max_align_t));
+    // reuse a freed block of the same size if possible
+    for (size_t i = 0; i < 4 && arena->free_lists[i].size; ++i) {
+        if (arena->free_lists[i].size == size && arena->free_lists[i].head) {
+            void *block = arena->free_lists[i].head;
+            arena->free_lists[i].head = *(void **)block;
+            return block;
+        }
+    }
+    if ((size_t)(arena->end - arena->next) < size) {
+        size_t header = set_align_up(sizeof(set_arena_chunk),
+                                     _Alignof(max_align_t));
+        size_t chunk_size = arena->chunk_size;
+        if (chunk_size < header + size) {
+            chunk_size = header + size;
+        }
+        set_arena_chunk *chunk = malloc(chunk_size);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->next = (char *)chunk + header;
+        arena->end = (char *)chunk + chunk_size;
+        // grow geometrically, so large sets need few chunks
+        if (arena->chunk_size < SET_ARENA_MAX_CHUNK) {
+            arena->chunk_size *= 2;
+        }
     }
+    void *block = arena->next;
+    arena->next += size;
+    return block;
 }
 
-void set_insert_in_node(set_node* node, void *elem, size_t elem_size,
-        set_node *right_child, set_less_t less) {
-    // set elem_index to point where `elem` belongs in list of keys
-    size_t elem_index;
-    for(elem_index = 0; elem_index < node->n_keys; ++elem_index) {
-        if (less((void *)(node->data + elem_index * elem_size), elem)) {
-            break;
+static void set_arena_block_free(void *ctx, void *ptr, size_t size) {
+    set_arena *arena = ctx;
+    size = set_align_up(size, _Alignof(max_align_t));
+    for (size_t i = 0; i < 4; ++i) {
+        if (arena->free_lists[i].size == 0) {
+            arena->free_lists[i].size = size;
+        }
+        if (arena->free_lists[i].size == size) {
+            *(void **)ptr = arena->free_lists[i].head;
+            arena->free_lists[i].head = ptr;
+            return;
         }
     }
-    size_t max_keys = node->home_set->order - 1;
-    if (node->n_keys < max_keys) {
-        set_insert_in_node_simple(node, elem, elem_size, elem_index,
-                right_child, less);
+    // no list for this size; the block is reclaimed with the whole arena
+}
+
+static void set_arena_release(void *ctx) {
+    set_arena_free(ctx);
+}
+
+set_allocator set_arena_allocator(set_arena *arena) {
+    return (set_allocator){set_arena_alloc, set_arena_block_free,
+                           set_arena_release, arena};
+}
+
+/* Frozen sets keep their elements in an array in Eytzinger order: index 1
+ * holds the root of an implicit complete binary search tree, and the children
+ * of index `i` are at `2 i` and `2 i + 1`. A search descends by computing the
+ * next index from the comparison, with no branch on its result, and
+ * prefetches the cache line holding the descendants a few levels below, so
+ * that the misses of later levels overlap with the comparisons of earlier
+ * ones. The array is cache line aligned and index 0 is unused, so the
+ * descendants of `i` on one level share a cache line.
+ */
+
+// How far below index `i` a frozen search prefetches: to index `i * ahead`,
+// the first of `ahead` consecutive descendants, which a cache line holds
+static inline size_t set_frozen_ahead(size_t elem_size) {
+    size_t ahead = 2;
+    while (ahead * 2 * elem_size <= 64) {
+        ahead *= 2;
     }
-    else {
-        set_insert_in_node_complex(node, elem, elem_size, elem_index,
-                right_child, less);
+    return ahead;
+}
+
+// Where a frozen search which stopped at index `i` (past the end of the
+// array) found the first element not less than the probe: the ancestor
+// whose left subtree it last went down, found by dropping the trailing
+// right turns and one more level. 0 means every element is less.
+static inline size_t set_frozen_lower_bound(size_t i) {
+#if defined(__GNUC__)
+    return i >> (__builtin_ctzll(~(unsigned long long)i) + 1);
+#else
+    while (i & 1) {
+        i >>= 1;
+    }
+    return i >> 1;
+#endif
+}
+
+// Index of the element after index `i` of a frozen set of `n` elements, or
+// the first if `i` is 0, or 0 if there is none: the leftmost index of the
+// right subtree if there is one, and otherwise the nearest ancestor whose
+// left subtree `i` is in.
+static size_t set_frozen_next(size_t i, size_t n) {
+    if (2 * i + 1 <= n) {
+        i = 2 * i + 1;
+        while (2 * i <= n) {
+            i *= 2;
+        }
+        return i;
     }
+    return set_frozen_lower_bound(i);
 }
 
-void set_tree_insert(set_node *node, void *elem, size_t elem_size,
-        set_less_t less) {
-    // if leaf, add to node
-    if (node->children == NULL) {
-        set_insert_in_node(node, elem, elem_size, NULL, less);
+/* Typed node searches. Each finds the index of the first key in `node` which
+ * is not less than `elem` (see `set_node_search`) using the native `<` on
+ * `type`, so that the comparisons are inlined. The linear variant counts keys
+ * below `elem` instead of stopping at the first key which is not, which
+ * is branch-free and lets the compiler vectorize it. Where the CPU allows, it
+ * uses the explicit SIMD counts above on `width` bit signed keys, with sign bit
+ * `flip` for unsigned types.
+ */
+#define SET_DEFINE_TYPED(name, type, kind, width, flip)                       \
+    bool name##_less(void *x, void *y) {                                      \
+        return *(type *)x < *(type *)y;                                       \
+    }                                                                         \
+                                                                              \
+    static size_t name##_node_search(set *s, set_node *node, type elem,       \
+                                     bool *found) {                           \
+        type *keys = set_node_key(s, node, 0);                                \
+        size_t n_keys = node->n_keys;                                         \
+        size_t elem_index = 0;                                                \
+        if (s->binary_search) {                                               \
+            size_t high = n_keys;                                             \
+            while (elem_index < high) {                                       \
+                size_t mid = elem_index + (high - elem_index) / 2;            \
+                if (keys[mid] < elem) {                                       \
+                    elem_index = mid + 1;                                     \
+                }                                                             \
+                else {                                                        \
+                    high = mid;                                               \
+                }                                                             \
+            }                                                                 \
+        }                                                                     \
+        else if (s->simd != SET_SIMD_NONE) {                                  \
+            elem_index = set_simd_count_less_##width(s->simd, keys, n_keys,   \
+                    (int##width##_t)elem, flip);                              \
+        }                                                                     \
+        else {                                                                \
+            for (size_t key = 0; key < n_keys; ++key) {                       \
+                elem_index += keys[key] < elem;                               \
+            }                                                                 \
+        }                                                                     \
+        *found = elem_index < n_keys && !(elem < keys[elem_index]);           \
+        return elem_index;                                                    \
+    }                                                                         \
+                                                                              \
+    static size_t name##_frozen_search(set *s, type elem, bool *found) {      \
+        const type *keys = s->frozen;                                         \
+        size_t n = s->size;                                                   \
+        size_t ahead = set_frozen_ahead(sizeof(type));                        \
+        size_t i = 1;                                                         \
+        while (i <= n) {                                                      \
+            SET_COUNT(s, node_visits, 1);                                     \
+            SET_PREFETCH((void *)((uintptr_t)keys                             \
+                                  + i * ahead * sizeof(type)));               \
+            i = 2 * i + (keys[i] < elem);                                     \
+        }                                                                     \
+        i = set_frozen_lower_bound(i);                                        \
+        *found = i != 0 && !(elem < keys[i]);                                 \
+        return i;                                                             \
+    }                                                                         \
+                                                                              \
+    void name##_init(set *s, uint16_t order) {                                \
+        set_init(s, order, name##_less, sizeof(type));                        \
+        s->key_kind = kind;                                                   \
+        /* the branch-free count beats bisection at every order */            \
+        s->binary_search = false;                                             \
+    }                                                                         \
+                                                                              \
+    bool name##_contains(set *s, type elem, type *copy_out) {                 \
+        return set_contains(s, &elem, copy_out);                              \
+    }                                                                         \
+                                                                              \
+    uint16_t name##_init_auto(set *s, enum set_node_target target) {          \
+        uint16_t order = set_auto_order(sizeof(type), target);                \
+        name##_init(s, order);                                                \
+        set_align_nodes(s, target);                                           \
+        return order;                                                         \
+    }                                                                         \
+                                                                              \
+    void name##_insert(set *s, type elem) {                                   \
+        set_insert(s, &elem);                                                 \
     }
-    // pass to appropriate child
-    uintptr_t data = node->data;
-    for (size_t key = 0; key < node->n_keys; ++key) {
-        void *stored = (void *)(data + key*elem_size);
-        if (less(elem, stored)) {
-            // do nothing if elem eqivalent to stored key
-            if (less(stored, elem)) {
-                return;
+
+SET_DEFINE_TYPED(set_i32, int32_t, SET_KEY_I32, 32, 0)
+SET_DEFINE_TYPED(set_u32, uint32_t, SET_KEY_U32, 32, INT32_MIN)
+SET_DEFINE_TYPED(set_i64, int64_t, SET_KEY_I64, 64, 0)
+SET_DEFINE_TYPED(set_u64, uint64_t, SET_KEY_U64, 64, INT64_MIN)
+
+// `set_node_search` for sets with a `cmp`, which tells at each key whether it
+// is equivalent to `elem` too, so needs no further call to set `found`
+static size_t set_cmp_node_search(set *s, set_node *node, const void *elem,
+                                  bool *found) {
+    size_t elem_index = 0;
+    size_t high = node->n_keys;
+    *found = false;
+    if (s->binary_search) {
+        while (elem_index < high) {
+            size_t mid = elem_index + (high - elem_index) / 2;
+            int order = set_compare(s, set_node_key(s, node, mid), elem);
+            if (order < 0) {
+                elem_index = mid + 1;
             }
-            set_tree_insert(node->children[key], elem, elem_size, less);
-            return;
+            else if (order > 0) {
+                high = mid;
+            }
+            else {
+                *found = true;
+                return mid;
+            }
+        }
+        return elem_index;
+    }
+    for (; elem_index < high; ++elem_index) {
+        int order = set_compare(s, set_node_key(s, node, elem_index), elem);
+        if (order >= 0) {
+            *found = order == 0;
+            break;
         }
     }
-    // if elem is not less than or equivalent to any of the stored keys,
-    // then it is greater than all of them and must be passed to the rightmost
-    // child
-    set_tree_insert(node->children[node->n_keys], elem, elem_size, less);
+    return elem_index;
 }
 
-void set_insert(set *s, void *elem) {
-    if (s->root == NULL) {
-        s->root = calloc(1, sizeof(set_node));
-        set_node_init(s->root, s, NULL, 1, true);
-        memcpy((void *)s->root->data, elem, s->elem_size);
+/* Returns the index of the first key in `node` which is not less than `elem`,
+ * or `node->n_keys` if there is no such key. This is where `elem` is stored,
+ * if `node` contains it, and where it would be inserted otherwise. Sets
+ * `found` to whether the key at that index is equivalent to `elem`.
+ */
+size_t set_node_search(set *s, set_node *node, void *elem, bool *found) {
+    SET_COUNT(s, node_visits, 1);
+    switch (s->key_kind) {
+    case SET_KEY_I32:
+        return set_i32_node_search(s, node, *(int32_t *)elem, found);
+    case SET_KEY_U32:
+        return set_u32_node_search(s, node, *(uint32_t *)elem, found);
+    case SET_KEY_I64:
+        return set_i64_node_search(s, node, *(int64_t *)elem, found);
+    case SET_KEY_U64:
+        return set_u64_node_search(s, node, *(uint64_t *)elem, found);
+    default:
+        break;
+    }
+    if (s->cmp) {
+        return set_cmp_node_search(s, node, elem, found);
+    }
+    size_t elem_index = 0;
+    if (s->binary_search) {
+        size_t high = node->n_keys;
+        while (elem_index < high) {
+            size_t mid = elem_index + (high - elem_index) / 2;
+            if (set_less(s, set_node_key(s, node, mid), elem)) {
+                elem_index = mid + 1;
+            }
+            else {
+                high = mid;
+            }
+        }
     }
     else {
-        set_tree_insert(s->root, elem, s->elem_size, s->less);
+        while (elem_index < node->n_keys
+               && set_less(s, set_node_key(s, node, elem_index), elem)) {
+            ++elem_index;
+        }
     }
+    *found = elem_index < node->n_keys
+             && !set_less(s, elem, set_node_key(s, node, elem_index));
+    return elem_index;
 }
 
-void set_tree_map(set_node *node, size_t elem_size,
-        void (*func)(void *, void *), void *extra) {
-    // apply func to data
-    for (size_t key = 0; key < node->n_keys; ++key) {
-        void *stored = (void *)(node->data + key*elem_size);
-        func(stored, extra);
+/* Returns the index in the Eytzinger array of frozen set `s` of the first
+ * element which is not less than `elem`, or 0 if there is none, and sets
+ * `found` to whether it is equivalent to `elem`.
+ */
+static size_t set_frozen_search(set *s, void *elem, bool *found) {
+    switch (s->key_kind) {
+    case SET_KEY_I32:
+        return set_i32_frozen_search(s, *(int32_t *)elem, found);
+    case SET_KEY_U32:
+        return set_u32_frozen_search(s, *(uint32_t *)elem, found);
+    case SET_KEY_I64:
+        return set_i64_frozen_search(s, *(int64_t *)elem, found);
+    case SET_KEY_U64:
+        return set_u64_frozen_search(s, *(uint64_t *)elem, found);
+    default:
+        break;
     }
-    // recursively apply func to children
-    if(node->children) {
-        for (size_t child = 0; child < node->n_keys + 1; ++child) {
-            set_tree_map(node->children[child], elem_size, func, extra);
+    const char *keys = s->frozen;
+    size_t elem_size = s->elem_size;
+    size_t n = s->size;
+    size_t ahead = set_frozen_ahead(elem_size);
+    size_t i = 1;
+    if (s->cmp) {
+        // an equivalent element is the lower bound, as elements are distinct
+        bool equal = false;
+        while (i <= n) {
+            SET_COUNT(s, node_visits, 1);
+            SET_PREFETCH((void *)((uintptr_t)keys + i * ahead * elem_size));
+            int order = set_compare(s, keys + i * elem_size, elem);
+            equal |= order == 0;
+            i = 2 * i + (order < 0);
         }
+        *found = equal;
+        return set_frozen_lower_bound(i);
     }
+    while (i <= n) {
+        SET_COUNT(s, node_visits, 1);
+        SET_PREFETCH((void *)((uintptr_t)keys + i * ahead * elem_size));
+        i = 2 * i + set_less(s, (void *)(keys + i * elem_size), elem);
+    }
+    i = set_frozen_lower_bound(i);
+    *found = i != 0 && !set_less(s, elem, (void *)(keys + i * elem_size));
+    return i;
 }
 
-void set_map(set *s, void (*func)(void *, void *), void *extra) {
-    set_tree_map(s->root, s->elem_size, func, extra);
+static bool set_frozen_contains(set *s, void *elem, void *copy_out) {
+    bool found;
+    size_t index = set_frozen_search(s, elem, &found);
+    if (found && copy_out) {
+        memcpy(copy_out, (char *)s->frozen + index * s->elem_size,
+               s->elem_size);
+    }
+    return found;
+}
+
+static bool set_contains_untimed(set *s, void *elem, void *copy_out) {
+    set_node *node = s->root;
+    if (!node) { // empty or frozen set
+        return s->frozen && set_frozen_contains(s, elem, copy_out);
+    }
+    bool found;
+    size_t elem_index;
+    while (!node->is_leaf) {
+        // separators equivalent to elem are the first key of the next child
+        elem_index = set_node_search(s, node, elem, &found);
+        node = set_node_child(s, node, elem_index + found);
+    }
+    elem_index = set_node_search(s, node, elem, &found);
+    if (found && copy_out) {
+        memcpy(copy_out, set_node_key(s, node, elem_index), s->elem_size);
+    }
+    return found;
+}
+
+bool set_contains(set *s, void *elem, void *copy_out) {
+#ifdef SET_STATS
+    uint64_t start = set_stats_now();
+    bool found = set_contains_untimed(s, elem, copy_out);
+    set_latency_record(&s->stats.contains, set_stats_now() - start);
+    return found;
+#else
+    return set_contains_untimed(s, elem, copy_out);
+#endif
+}
+
+// Number of probes `set_contains_batch` walks down the tree together
+#define SET_BATCH_GROUP 16
+
+// Prefetch the header and keys of `node`, which are what a search reads
+static inline void set_node_prefetch(const set *s, set_node *node) {
+    size_t size = s->keys_offset + (s->order - 1) * s->elem_size;
+    for (size_t line = 0; line < size; line += 64) {
+        SET_PREFETCH((char *)node + line);
+    }
+}
+
+size_t set_contains_batch(set *s, const void *keys, size_t n, bool *out,
+        void *copy_out) {
+    size_t elem_size = s->elem_size;
+    size_t n_found = 0;
+    if (s->frozen) {
+        // each search prefetches for itself
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = set_frozen_contains(s, (char *)keys + i * elem_size,
+                                         copy_out ? (char *)copy_out
+                                                    + i * elem_size
+                                                  : NULL);
+            n_found += out[i];
+        }
+        return n_found;
+    }
+    set_node *nodes[SET_BATCH_GROUP];
+    for (size_t group = 0; group < n; group += SET_BATCH_GROUP) {
+        size_t n_probes = n - group < SET_BATCH_GROUP ? n - group
+                                                      : SET_BATCH_GROUP;
+        void *probes = (char *)keys + group * elem_size;
+        if (!s->root) {
+            memset(out + group, 0, n_probes * sizeof(bool));
+            continue;
+        }
+        for (size_t probe = 0; probe < n_probes; ++probe) {
+            nodes[probe] = s->root;
+        }
+        // All leaves are at the same depth, so the probes move down one level
+        // at a time together. Each child is prefetched as soon as it is known,
+        // and is only searched after the other probes have taken their step,
+        // so the cache misses of the whole group overlap.
+        while (!nodes[0]->is_leaf) {
+            for (size_t probe = 0; probe < n_probes; ++probe) {
+                bool found;
+                set_node *node = nodes[probe];
+                size_t child = set_node_search(s, node,
+                        (char *)probes + probe * elem_size, &found) + found;
+                nodes[probe] = set_node_child(s, node, child);
+                set_node_prefetch(s, nodes[probe]);
+            }
+        }
+        for (size_t probe = 0; probe < n_probes; ++probe) {
+            bool found;
+            size_t elem_index = set_node_search(s, nodes[probe],
+                    (char *)probes + probe * elem_size, &found);
+            out[group + probe] = found;
+            if (found) {
+                ++n_found;
+                if (copy_out) {
+                    memcpy((char *)copy_out + (group + probe) * elem_size,
+                           set_node_key(s, nodes[probe], elem_index),
+                           elem_size);
+                }
+            }
+        }
+    }
+    return n_found;
+}
+
+// Descend optimistically from `start` (or the root, if NULL) towards `elem`,
+// for `levels` levels or until reaching a leaf, and return the node reached,
+// with its version in `*version`. Returns NULL if the tree is empty. Nodes may
+// be split by writers meanwhile: one whose high key is not above `elem` was
+// split after its parent was read, and the descent moves right from it. If
+// `path` is not NULL, the nodes descended from are stored in it, one per
+// level, and their number in `*depth`.
+static set_node *set_descend_shared(set *s, set_node *start, size_t levels,
+                                    void *elem, uint32_t *version,
+                                    set_node **path, size_t *depth) {
+restart:;
+    set_node *node = start ? start : set_root_load(s);
+    if (!node) {
+        return NULL;
+    }
+    uint32_t node_version = set_node_read_begin(node);
+    size_t level = 0;
+    for (;;) {
+        set_node *right = node->right_sibling;
+        bool beyond = right && !set_less(s, elem, set_node_high_key(s, node));
+        if (!set_node_read_valid(node, node_version)) {
+            goto restart;
+        }
+        if (beyond) {
+            node = right;
+            node_version = set_node_read_begin(node);
+            continue;
+        }
+        if (node->is_leaf || level == levels) {
+            break;
+        }
+        bool found;
+        size_t index = set_node_search(s, node, elem, &found);
+        set_node *child = set_node_children(s, node)[index + found];
+        // check the child pointer is whole before following it, and that the
+        // child was still node's once its version is known
+        if (!set_node_read_valid(node, node_version)) {
+            goto restart;
+        }
+        uint32_t child_version = set_node_read_begin(child);
+        if (!set_node_read_valid(node, node_version)) {
+            goto restart;
+        }
+        if (path) {
+            path[level] = node;
+        }
+        ++level;
+        node = child;
+        node_version = child_version;
+    }
+    *version = node_version;
+    if (depth) {
+        *depth = level;
+    }
+    return node;
+}
+
+bool set_contains_shared(set *s, void *elem, void *copy_out) {
+    for (;;) {
+        uint32_t version;
+        set_node *leaf = set_descend_shared(s, NULL, SIZE_MAX, elem, &version,
+                                            NULL, NULL);
+        if (!leaf) {
+            return false;
+        }
+        bool found;
+        size_t index = set_node_search(s, leaf, elem, &found);
+        if (found && copy_out) {
+            memcpy(copy_out, set_node_key(s, leaf, index), s->elem_size);
+        }
+        if (set_node_read_valid(leaf, version)) {
+            return found;
+        }
+    }
+}
+
+// forward declare insertion
+void set_insert_in_node(set *s, set_node* node, void *elem,
+        size_t elem_index, set_node *right_child);
+
+// Simple insert case: node not full so just insert in current node
+void set_insert_in_node_simple(set *s, set_node* node, void *elem,
+        size_t elem_index, set_node *right_child) {
+    size_t elem_size = s->elem_size;
+    void *elem_addr = set_node_key(s, node, elem_index);
+    // move elements after target
+    memmove((char *)elem_addr + elem_size, elem_addr,
+            (node->n_keys - elem_index) * elem_size);
+    memcpy(elem_addr, elem, elem_size);
+    if (!node->is_leaf) {
+        // right_child goes directly after elem
+        set_move_children(s, node, elem_index + 2, node, elem_index + 1,
+                          node->n_keys - elem_index);
+        set_put_child(s, node, elem_index + 1, right_child);
+    }
+    ++node->n_keys;
+}
+
+// Link `new_node`, just split off from `node`, in as the right sibling of
+// `node`. `new_node` takes over the high key of `node`, whose new high key is
+// `separator`.
+static void set_link_right(set *s, set_node *node, set_node *new_node,
+                           const void *separator) {
+    SET_COUNT(s, splits, 1);
+    new_node->right_sibling = node->right_sibling;
+    if (node->right_sibling) {
+        memcpy(set_node_high_key(s, new_node), set_node_high_key(s, node),
+               s->elem_size);
+    }
+    memcpy(set_node_high_key(s, node), separator, s->elem_size);
+    node->right_sibling = new_node;
+}
+
+// Grow the tree by a level: the root `node` was split into itself and
+// `new_node`, with `separator` between them
+static void set_new_root(set *s, set_node *node, void *separator,
+                         set_node *new_node) {
+    set_node *new_root = set_node_init(s, NULL, NULL, 1, false);
+    memcpy(set_node_key(s, new_root, 0), separator, s->elem_size);
+    set_put_child(s, new_root, 0, node);
+    set_put_child(s, new_root, 1, new_node);
+    set_root_store(s, new_root);
+}
+
+// After `node` was split, insert `separator` with `new_node` as the child
+// directly after it into the parent of `node`, making a new root if needed
+void set_insert_in_parent(set *s, set_node *node, void *separator,
+        set_node *new_node) {
+    if (node->parent) {
+        bool found;
+        set_insert_in_node(s, node->parent, separator,
+                set_node_search(s, node->parent, separator, &found),
+                new_node);
+    }
+    else { // this is the root
+        set_new_root(s, node, separator, new_node);
+    }
+}
+
+// Complex insert case for leaves: split this leaf in two, and return the new
+// right leaf. A copy of its first key is the separator the caller must insert
+// into the parent. The left leaf keeps the larger half.
+set_node *set_insert_in_leaf_complex(set *s, set_node* node, void *elem,
+        size_t elem_index) {
+    size_t elem_size = s->elem_size;
+    size_t n_keys = node->n_keys; // == max keys
+    size_t n_old = n_keys / 2 + 1; // ceiling of (max_keys + 1) / 2
+    size_t n_new = n_keys + 1 - n_old;
+
+    // allocate new right leaf. Current leaf becomes left leaf
+    set_node *new_node = set_node_init(s, node->parent, NULL, n_new, true);
+
+    if (elem_index < n_old) { // elem goes in left (old) half
+        memcpy(set_node_key(s, new_node, 0), set_node_key(s, node, n_old - 1),
+               n_new * elem_size);
+        void *elem_addr = set_node_key(s, node, elem_index);
+        memmove((char *)elem_addr + elem_size, elem_addr,
+                (n_old - 1 - elem_index) * elem_size);
+        memcpy(elem_addr, elem, elem_size);
+    }
+    else { // elem goes in right (new) half
+        size_t insert_index = elem_index - n_old;
+        memcpy(set_node_key(s, new_node, 0), set_node_key(s, node, n_old),
+               insert_index * elem_size);
+        memcpy(set_node_key(s, new_node, insert_index), elem, elem_size);
+        memcpy(set_node_key(s, new_node, insert_index + 1),
+               set_node_key(s, node, elem_index),
+               (n_keys - elem_index) * elem_size);
+    }
+    node->n_keys = n_old;
+    set_link_right(s, node, new_node, set_node_key(s, new_node, 0));
+    return new_node;
+}
+
+// Complex insert case for internal nodes: split this node in two, and insert
+// median value into parent node. If the max number of keys is odd, left node
+// will end up with one more key than the right node. This reduces copying,
+// and left-biases the data (which is slightly faster since we are using less
+// for querying). Returns the new right node, and sets `*separator` to the
+// median, which the caller must insert into the parent.
+set_node *set_insert_in_node_complex(set *s, set_node* node, void *elem,
+        size_t elem_index, set_node *right_child, void **separator) {
+    size_t elem_size = s->elem_size;
+    size_t n_keys = node->n_keys; // == max keys
+    size_t n_old = (n_keys - 1) / 2 + 1; // ceiling of max_keys / 2
+    size_t n_new = n_keys - n_old;
+
+    // allocate new right node. Current node becomes left node
+    set_node *new_node = set_node_init(s, node->parent, NULL, n_new, false);
+
+    // Conceptually, elem is inserted at elem_index, then the first n_old keys
+    // stay here, the next is the pivot which moves up to the parent, and the
+    // rest move to new_node. The pivot is parked in new_node's last key slot,
+    // which is always free, so that it survives a split of the parent.
+    void *pivot = set_node_key(s, new_node, n_keys - 1);
+    if (elem_index < n_old) { // elem goes in left (old) half
+        memcpy(pivot, set_node_key(s, node, n_old - 1), elem_size);
+        memcpy(set_node_key(s, new_node, 0), set_node_key(s, node, n_old),
+               n_new * elem_size);
+        void *elem_addr = set_node_key(s, node, elem_index);
+        memmove((char *)elem_addr + elem_size, elem_addr,
+                (n_old - 1 - elem_index) * elem_size);
+        memcpy(elem_addr, elem, elem_size);
+    }
+    else if (elem_index == n_old) { // elem is the pivot
+        pivot = elem;
+        memcpy(set_node_key(s, new_node, 0), set_node_key(s, node, n_old),
+               n_new * elem_size);
+    }
+    else { // elem goes in right (new) half
+        size_t insert_index = elem_index - n_old - 1;
+        memcpy(pivot, set_node_key(s, node, n_old), elem_size);
+        memcpy(set_node_key(s, new_node, 0), set_node_key(s, node, n_old + 1),
+               insert_index * elem_size);
+        memcpy(set_node_key(s, new_node, insert_index), elem, elem_size);
+        memcpy(set_node_key(s, new_node, insert_index + 1),
+               set_node_key(s, node, elem_index),
+               (n_keys - elem_index) * elem_size);
+    }
+
+    // split children the same way, with right_child directly after elem
+    if (elem_index < n_old) {
+        set_move_children(s, new_node, 0, node, n_old, n_new + 1);
+        set_move_children(s, node, elem_index + 2, node, elem_index + 1,
+                          n_old - 1 - elem_index);
+        set_put_child(s, node, elem_index + 1, right_child);
+    }
+    else {
+        size_t insert_index = elem_index - n_old;
+        set_move_children(s, new_node, 0, node, n_old + 1, insert_index);
+        set_move_children(s, new_node, insert_index + 1, node, elem_index + 1,
+                          n_keys - elem_index);
+        set_put_child(s, new_node, insert_index, right_child);
+    }
+    set_node **new_children = set_node_children(s, new_node);
+    for (size_t child = 0; child < n_new + 1; ++child) {
+        new_children[child]->parent = new_node;
+    }
+
+    // update n_keys
+    node->n_keys = n_old;
+    set_link_right(s, node, new_node, pivot);
+    *separator = pivot;
+    return new_node;
+}
+
+// Insert `elem` at `elem_index` in `node`, with `right_child` (if `node` is
+// not a leaf) as the child directly after it
+void set_insert_in_node(set *s, set_node* node, void *elem,
+        size_t elem_index, set_node *right_child) {
+    size_t max_keys = s->order - 1;
+    if (!node->is_leaf && s->counts_offset) {
+        // the child before right_child was just split, so its size changed
+        set_node_counts(s, node)[elem_index] =
+            set_subtree_size(s, set_node_children(s, node)[elem_index]);
+    }
+    // node stays locked until any splits above it are done, so readers which
+    // reach it through a stale parent retry
+    set_node_write_begin(node);
+    if (node->n_keys < max_keys) {
+        set_insert_in_node_simple(s, node, elem, elem_index, right_child);
+    }
+    else {
+        void *separator;
+        set_node *new_node;
+        if (node->is_leaf) {
+            new_node = set_insert_in_leaf_complex(s, node, elem, elem_index);
+            separator = set_node_key(s, new_node, 0);
+        }
+        else {
+            new_node = set_insert_in_node_complex(s, node, elem, elem_index,
+                                                  right_child, &separator);
+        }
+        set_insert_in_parent(s, node, separator, new_node);
+    }
+    set_node_write_end(node);
+}
+
+static void set_insert_untimed(set *s, void *elem) {
+    if (s->root == NULL) {
+        set_node *root = set_node_init(s, NULL, NULL, 1, true);
+        memcpy(set_node_key(s, root, 0), elem, s->elem_size);
+        set_root_store(s, root);
+        s->size = 1;
+        return;
+    }
+    set_node *node = set_private_root(s);
+    set_node *left = NULL; // of node on its level, if s shares nodes
+    size_t path[SET_MAX_DEPTH]; // child taken at each level
+    size_t depth = 0;
+    bool found;
+    size_t elem_index;
+    while (node && !node->is_leaf) {
+        elem_index = set_node_search(s, node, elem, &found) + found;
+        path[depth++] = elem_index;
+        node = set_child_for_write(s, node, elem_index, &left);
+    }
+    if (!node) {
+        return; // a shared node could not be copied
+    }
+    elem_index = set_node_search(s, node, elem, &found);
+    // do nothing if elem eqivalent to stored key
+    if (!found) {
+        ++s->size;
+        // sizes of nodes which split are recomputed as they split
+        set_count_path(s, node, path, depth, 1);
+        set_insert_in_node(s, node, elem, elem_index, NULL);
+    }
+}
+
+void set_insert(set *s, void *elem) {
+#ifdef SET_STATS
+    uint64_t start = set_stats_now();
+    set_insert_untimed(s, elem);
+    set_latency_record(&s->stats.insert, set_stats_now() - start);
+#else
+    set_insert_untimed(s, elem);
+#endif
+}
+
+// With `node` locked, move right past any nodes split off from it since the
+// descent towards `key` read its parent. Returns the node whose range holds
+// `key`, locked; the others are unlocked.
+static set_node *set_lock_right(set *s, set_node *node, void *key) {
+    while (node->right_sibling
+           && !set_less(s, key, set_node_high_key(s, node))) {
+        set_node *right = node->right_sibling;
+        set_node_lock(right);
+        set_node_write_end(node);
+        node = right;
+    }
+    return node;
+}
+
+bool set_insert_shared(set *s, void *elem) {
+    size_t max_keys = s->order - 1;
+    set_node *path[SET_MAX_DEPTH]; // nodes passed on the way down
+    size_t depth;
+    uint32_t version;
+    set_node *node;
+    while (!(node = set_descend_shared(s, NULL, SIZE_MAX, elem, &version,
+                                       path, &depth))) {
+        // empty: race the other writers to install the first leaf
+        set_node *root = set_node_init(s, NULL, NULL, 1, true);
+        if (!root) {
+            return false;
+        }
+        memcpy(set_node_key(s, root, 0), elem, s->elem_size);
+        set_node *expected = NULL;
+        if (atomic_compare_exchange_strong_explicit(
+                (_Atomic(set_node *) *)&s->root, &expected, root,
+                memory_order_release, memory_order_relaxed)) {
+            atomic_fetch_add_explicit((_Atomic size_t *)&s->size, 1,
+                                      memory_order_relaxed);
+            return true;
+        }
+        set_node_release(s, root);
+    }
+    set_node_lock(node);
+    node = set_lock_right(s, node, elem);
+    bool found;
+    size_t index = set_node_search(s, node, elem, &found);
+    if (found) {
+        set_node_write_end(node);
+        return true;
+    }
+    // a full leaf splits, and the separator then needs a copy of its own
+    char *separator = NULL; // copy of the key being inserted a level up
+    if (node->n_keys == max_keys
+        && !(separator = malloc(s->elem_size))) {
+        set_node_write_end(node);
+        return false;
+    }
+    atomic_fetch_add_explicit((_Atomic size_t *)&s->size, 1,
+                              memory_order_relaxed);
+
+    // Insert, splitting upwards while nodes are full. A split node is linked
+    // to its new sibling before it is unlocked, so descents which reach it
+    // before the parent learns of the sibling move right to it instead of
+    // waiting. Each node stays locked until its parent is; locks are only
+    // taken upwards or rightwards, so writers cannot deadlock.
+    void *key = elem;
+    set_node *right_child = NULL;
+    size_t level = 0; // of node, counting up from the leaves
+    for (;;) {
+        if (node->n_keys < max_keys) {
+            set_insert_in_node_simple(s, node, key, index, right_child);
+            set_node_write_end(node);
+            break;
+        }
+        void *split_key;
+        set_node *new_node;
+        if (node->is_leaf) {
+            new_node = set_insert_in_leaf_complex(s, node, key, index);
+            split_key = set_node_key(s, new_node, 0);
+        }
+        else {
+            new_node = set_insert_in_node_complex(s, node, key, index,
+                                                  right_child, &split_key);
+        }
+        // other writers may change new_node once node is unlocked
+        memmove(separator, split_key, s->elem_size);
+        key = separator;
+        right_child = new_node;
+        ++level;
+        set_node *parent;
+        if (depth > 0) {
+            parent = path[--depth];
+        }
+        else if (set_root_load(s) == node) {
+            // only the holder of the root's lock can replace the root
+            set_new_root(s, node, separator, new_node);
+            set_node_write_end(node);
+            break;
+        }
+        else {
+            // the tree grew above where the descent started: find the
+            // parent from the root. Levels never change, and the first
+            // child of a node is never moved, so the height is stable.
+            set_node *root = set_root_load(s);
+            size_t height = 0;
+            for (set_node *n = root; !n->is_leaf;
+                 n = set_node_children(s, n)[0]) {
+                ++height;
+            }
+            parent = set_descend_shared(s, root, height - level, separator,
+                                        &version, NULL, NULL);
+        }
+        set_node_lock(parent);
+        parent = set_lock_right(s, parent, separator);
+        set_node_write_end(node);
+        node = parent;
+        index = set_node_search(s, node, key, &found);
+    }
+    free(separator);
+    return true;
+}
+
+// Insertion sort of each block of SET_SORT_BLOCK elements, then bottom-up
+// merge sort using `tmp` (room for `n` elements). Stable.
+#define SET_SORT_BLOCK 8
+
+static void set_sort(set *s, char *elems, size_t n, char *tmp) {
+    size_t elem_size = s->elem_size;
+    for (size_t block = 0; block < n; block += SET_SORT_BLOCK) {
+        size_t end = block + SET_SORT_BLOCK < n ? block + SET_SORT_BLOCK : n;
+        for (size_t i = block + 1; i < end; ++i) {
+            size_t j = i;
+            memcpy(tmp, elems + i * elem_size, elem_size);
+            while (j > block && set_less(s, tmp, elems + (j - 1) * elem_size)) {
+                --j;
+            }
+            memmove(elems + (j + 1) * elem_size, elems + j * elem_size,
+                    (i - j) * elem_size);
+            memcpy(elems + j * elem_size, tmp, elem_size);
+        }
+    }
+    char *src = elems;
+    char *dst = tmp;
+    for (size_t width = SET_SORT_BLOCK; width < n; width *= 2) {
+        for (size_t left = 0; left < n; left += 2 * width) {
+            size_t mid = left + width < n ? left + width : n;
+            size_t end = left + 2 * width < n ? left + 2 * width : n;
+            size_t i = left, j = mid, out = left;
+            while (i < mid && j < end) {
+                // take from the right run only if strictly less, for stability
+                if (set_less(s, src + j * elem_size, src + i * elem_size)) {
+                    memcpy(dst + out++ * elem_size, src + j++ * elem_size,
+                           elem_size);
+                }
+                else {
+                    memcpy(dst + out++ * elem_size, src + i++ * elem_size,
+                           elem_size);
+                }
+            }
+            memcpy(dst + out * elem_size, src + i * elem_size,
+                   (mid - i) * elem_size);
+            out += mid - i;
+            memcpy(dst + out * elem_size, src + j * elem_size,
+                   (end - j) * elem_size);
+        }
+        char *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != elems) {
+        memcpy(elems, src, n * elem_size);
+    }
+}
+
+// Merge the sorted run of `n_run` elements at `run` into `leaf`, skipping
+// elements it already holds. `tmp` must have room for `order - 1 + n_run`
+// elements. If the result does not fit, the leaf is split once into as many
+// evenly filled leaves as needed, which are added to the parent in order.
+// `path` and `depth` are as for `set_count_path`. Returns false, leaving
+// `leaf` unchanged, if the new leaves cannot be allocated.
+static bool set_merge_into_leaf(set *s, set_node *leaf, const char *run,
+                                size_t n_run, char *tmp, const size_t *path,
+                                size_t depth) {
+    size_t elem_size = s->elem_size;
+    size_t max_keys = s->order - 1;
+    char *keys = set_node_key(s, leaf, 0);
+    size_t i = 0, j = 0, total = 0;
+    while (i < leaf->n_keys && j < n_run) {
+        char *key = keys + i * elem_size;
+        const char *elem = run + j * elem_size;
+        int order = set_compare(s, key, elem);
+        if (order < 0) {
+            memcpy(tmp + total++ * elem_size, key, elem_size);
+            ++i;
+        }
+        else {
+            if (order > 0) {
+                memcpy(tmp + total++ * elem_size, elem, elem_size);
+            }
+            ++j; // equivalent elements are already in the set
+        }
+    }
+    memcpy(tmp + total * elem_size, keys + i * elem_size,
+           (leaf->n_keys - i) * elem_size);
+    total += leaf->n_keys - i;
+    memcpy(tmp + total * elem_size, run + j * elem_size,
+           (n_run - j) * elem_size);
+    total += n_run - j;
+    size_t n_leaves = (total + max_keys - 1) / max_keys;
+    // allocate the new leaves before changing anything, chained through
+    // their right siblings
+    set_node *spare = NULL;
+    for (size_t piece = 1; piece < n_leaves; ++piece) {
+        set_node *new_leaf = set_node_init(s, NULL, spare, 0, true);
+        if (!new_leaf) {
+            while (spare) {
+                set_node *next = spare->right_sibling;
+                set_node_release(s, spare);
+                spare = next;
+            }
+            return false;
+        }
+        spare = new_leaf;
+    }
+    s->size += total - leaf->n_keys;
+
+    // The new leaves are locked, filled and chained to the right of `leaf`,
+    // with their final high keys, before the parent learns of any of them.
+    // All stay locked until the last is in the parent, so a reader which
+    // reaches one before then retries rather than missing keys which belong
+    // in a later one.
+    set_node_write_begin(leaf);
+    size_t n_keys = total / n_leaves + (0 < total % n_leaves);
+    // Each piece is counted in its ancestors only as it is added: a parent
+    // which splits recounts its children, and must not miss pieces counted
+    // ahead of time but not yet added.
+    set_count_path(s, leaf, path, depth, n_keys - leaf->n_keys);
+    memcpy(keys, tmp, n_keys * elem_size);
+    leaf->n_keys = n_keys;
+    const char *next = tmp + n_keys * elem_size;
+    set_node *last = leaf;
+    for (size_t piece = 1; piece < n_leaves; ++piece) {
+        n_keys = total / n_leaves + (piece < total % n_leaves);
+        set_node *new_leaf = spare;
+        spare = spare->right_sibling;
+        set_node_write_begin(new_leaf);
+        new_leaf->parent = leaf->parent;
+        new_leaf->n_keys = n_keys;
+        memcpy(set_node_key(s, new_leaf, 0), next, n_keys * elem_size);
+        next += n_keys * elem_size;
+        set_link_right(s, last, new_leaf, set_node_key(s, new_leaf, 0));
+        last = new_leaf;
+    }
+    for (set_node *prev = leaf; prev != last;) {
+        set_node *new_leaf = prev->right_sibling;
+        // counted under prev until the parent recounts prev and adds it
+        set_count_ancestors(s, prev, new_leaf->n_keys);
+        set_insert_in_parent(s, prev, set_node_key(s, new_leaf, 0), new_leaf);
+        prev = new_leaf;
+    }
+    for (set_node *piece = leaf;; piece = piece->right_sibling) {
+        set_node_write_end(piece);
+        if (piece == last) {
+            break;
+        }
+    }
+    return true;
+}
+
+bool set_insert_batch(set *s, void *elems, size_t n) {
+    if (n == 0) {
+        return true;
+    }
+    size_t elem_size = s->elem_size;
+    char *tmp = malloc((n + s->order - 1) * elem_size);
+    if (!tmp) {
+        return false;
+    }
+    char *batch = elems;
+    set_sort(s, batch, n, tmp);
+    // drop equivalent elements, keeping the first
+    size_t n_unique = 1;
+    for (size_t i = 1; i < n; ++i) {
+        if (set_less(s, batch + (n_unique - 1) * elem_size, batch + i * elem_size)) {
+            memmove(batch + n_unique++ * elem_size, batch + i * elem_size,
+                    elem_size);
+        }
+    }
+    n = n_unique;
+    if (!s->root) {
+        set_node *root = set_node_init(s, NULL, NULL, 0, true);
+        if (!root) {
+            free(tmp);
+            return false;
+        }
+        set_root_store(s, root);
+    }
+    size_t start = 0;
+    while (start < n) {
+        // find the leaf for the next element, and the separator bounding
+        // that leaf on the right (NULL if it is the rightmost leaf)
+        void *elem = batch + start * elem_size;
+        set_node *node = set_private_root(s);
+        set_node *left = NULL;
+        void *upper = NULL;
+        size_t path[SET_MAX_DEPTH];
+        size_t depth = 0;
+        while (node && !node->is_leaf) {
+            bool found;
+            size_t child = set_node_search(s, node, elem, &found) + found;
+            path[depth++] = child;
+            if (child < node->n_keys) {
+                upper = set_node_key(s, node, child);
+            }
+            node = set_child_for_write(s, node, child, &left);
+        }
+        if (!node) { // a shared node could not be copied
+            free(tmp);
+            return false;
+        }
+        // every following element below `upper` belongs in the same leaf
+        size_t end = start + 1;
+        while (end < n
+               && (!upper || set_less(s, batch + end * elem_size, upper))) {
+            ++end;
+        }
+        if (!set_merge_into_leaf(s, node, elem, end - start, tmp, path,
+                                 depth)) {
+            free(tmp);
+            return false;
+        }
+        start = end;
+    }
+    free(tmp);
+    return true;
+}
+
+// Remove key `key_index` and the child just after it from internal `node`
+static void set_node_remove(set *s, set_node *node, size_t key_index) {
+    size_t elem_size = s->elem_size;
+    char *key = set_node_key(s, node, key_index);
+    memmove(key, key + elem_size, (node->n_keys - key_index - 1) * elem_size);
+    set_move_children(s, node, key_index + 1, node, key_index + 2,
+                      node->n_keys - key_index - 1);
+    --node->n_keys;
+}
+
+// Move all keys (and children) of `right` to the end of `left`, its sibling
+// to the left under the same parent, whose separator between them is
+// `separator`. Unlinks and frees `right`; the caller removes the separator.
+static void set_merge_nodes(set *s, set_node *left, set_node *right,
+                            void *separator) {
+    size_t elem_size = s->elem_size;
+    if (left->is_leaf) {
+        memcpy(set_node_key(s, left, left->n_keys), set_node_key(s, right, 0),
+               right->n_keys * elem_size);
+        left->n_keys += right->n_keys;
+    }
+    else {
+        // the separator comes down between the two nodes' keys
+        memcpy(set_node_key(s, left, left->n_keys), separator, elem_size);
+        memcpy(set_node_key(s, left, left->n_keys + 1),
+               set_node_key(s, right, 0), right->n_keys * elem_size);
+        set_move_children(s, left, left->n_keys + 1, right, 0,
+                          right->n_keys + 1);
+        set_node **children = set_node_children(s, left) + left->n_keys + 1;
+        for (size_t child = 0; child < (size_t)right->n_keys + 1; ++child) {
+            children[child]->parent = left;
+        }
+        left->n_keys += right->n_keys + 1;
+    }
+    left->right_sibling = right->right_sibling;
+    if (right->right_sibling) {
+        memcpy(set_node_high_key(s, left), set_node_high_key(s, right),
+               elem_size);
+    }
+    set_node_release(s, right);
+}
+
+// Move the last key (and child) of `left` to the front of `node`, its sibling
+// to the right, updating their separator in the parent
+static void set_borrow_left(set *s, set_node *node, set_node *left,
+                            void *separator) {
+    size_t elem_size = s->elem_size;
+    char *keys = set_node_key(s, node, 0);
+    memmove(keys + elem_size, keys, node->n_keys * elem_size);
+    if (node->is_leaf) {
+        memcpy(keys, set_node_key(s, left, left->n_keys - 1), elem_size);
+        memcpy(separator, keys, elem_size);
+    }
+    else {
+        // rotate through the parent
+        memcpy(keys, separator, elem_size);
+        memcpy(separator, set_node_key(s, left, left->n_keys - 1), elem_size);
+        set_move_children(s, node, 1, node, 0, node->n_keys + 1);
+        set_put_child(s, node, 0, set_node_children(s, left)[left->n_keys]);
+    }
+    ++node->n_keys;
+    --left->n_keys;
+    memcpy(set_node_high_key(s, left), separator, elem_size);
+}
+
+// Move the first key (and child) of `right` to the end of `node`, its sibling
+// to the left, updating their separator in the parent
+static void set_borrow_right(set *s, set_node *node, set_node *right,
+                             void *separator) {
+    size_t elem_size = s->elem_size;
+    char *right_keys = set_node_key(s, right, 0);
+    if (node->is_leaf) {
+        memcpy(set_node_key(s, node, node->n_keys), right_keys, elem_size);
+        memcpy(separator, right_keys + elem_size, elem_size);
+    }
+    else {
+        // rotate through the parent
+        memcpy(set_node_key(s, node, node->n_keys), separator, elem_size);
+        memcpy(separator, right_keys, elem_size);
+        set_put_child(s, node, node->n_keys + 1,
+                      set_node_children(s, right)[0]);
+        set_move_children(s, right, 0, right, 1, right->n_keys);
+    }
+    memmove(right_keys, right_keys + elem_size,
+            (right->n_keys - 1) * elem_size);
+    ++node->n_keys;
+    --right->n_keys;
+    memcpy(set_node_high_key(s, node), separator, elem_size);
+}
+
+// Restore the minimum fill of `node` after it lost a key, by borrowing from a
+// sibling under the same parent or merging with one. Merging takes a key from
+// the parent, so may continue up the tree. `node` is at depth `depth`, and if
+// `s` shares nodes, `lefts` holds the node left of each node on its path.
+static void set_rebalance(set *s, set_node *node, set_node **lefts,
+                          size_t depth) {
+    size_t order = s->order;
+    for (;; --depth) {
+        set_node *parent = node->parent;
+        if (!parent) { // root
+            if (node->n_keys == 0) {
+                if (node->is_leaf) {
+                    s->root = NULL;
+                }
+                else { // shrink the tree by one level
+                    s->root = set_node_children(s, node)[0];
+                    s->root->parent = NULL;
+                }
+                set_node_release(s, node);
+            }
+            return;
+        }
+        // fewest keys a node may have, and whether a sibling may lend one
+        size_t min_keys = node->is_leaf ? order / 2 : (order + 1) / 2 - 1;
+        if (node->n_keys >= min_keys) {
+            return;
+        }
+        size_t index = set_child_index(s, parent, node);
+        set_node **siblings = set_node_children(s, parent);
+        set_node *left = index > 0 ? siblings[index - 1] : NULL;
+        set_node *right = index < parent->n_keys ? siblings[index + 1] : NULL;
+        // whichever sibling changes must not be shared. The parent and node,
+        // on the path down, already are not.
+        bool use_left = left && (left->n_keys > min_keys
+                                 || right == NULL || right->n_keys <= min_keys);
+        if (s->shares_nodes) {
+            set_node *sibling = use_left ? left : right;
+            if (sibling && atomic_load_explicit(&sibling->refs,
+                                                memory_order_relaxed) > 1) {
+                if (use_left) {
+                    left = set_unshare(s, parent, index - 1,
+                                       set_left_of_child(s, parent, index - 1,
+                                                         lefts[depth - 1]));
+                }
+                else {
+                    right = set_unshare(s, parent, index + 1, node);
+                }
+                if (!(use_left ? left : right)) {
+                    // out of memory: leave node short of keys (even empty),
+                    // which searches, cursors and later changes all allow
+                    return;
+                }
+            }
+        }
+        if (left && left->n_keys > min_keys) {
+            set_borrow_left(s, node, left, set_node_key(s, parent, index - 1));
+            set_put_child(s, parent, index - 1, left);
+            set_put_child(s, parent, index, node);
+            return;
+        }
+        if (right && right->n_keys > min_keys) {
+            set_borrow_right(s, node, right, set_node_key(s, parent, index));
+            set_put_child(s, parent, index, node);
+            set_put_child(s, parent, index + 1, right);
+            return;
+        }
+        if (left) {
+            set_merge_nodes(s, left, node, set_node_key(s, parent, index - 1));
+            set_node_remove(s, parent, index - 1);
+            set_put_child(s, parent, index - 1, left);
+        }
+        else {
+            set_merge_nodes(s, node, right, set_node_key(s, parent, index));
+            set_node_remove(s, parent, index);
+            set_put_child(s, parent, index, node);
+        }
+        node = parent;
+    }
+}
+
+bool set_erase(set *s, const void *elem, void *copy_out) {
+    set_node *node = set_private_root(s);
+    if (!node) {
+        return false;
+    }
+    size_t path[SET_MAX_DEPTH]; // child taken at each level
+    set_node *lefts[SET_MAX_DEPTH]; // node left of each on the path
+    size_t depth = 0;
+    bool found;
+    size_t elem_index;
+    lefts[0] = NULL;
+    while (!node->is_leaf) {
+        elem_index = set_node_search(s, node, (void *)elem, &found) + found;
+        path[depth++] = elem_index;
+        lefts[depth] = lefts[depth - 1];
+        node = set_child_for_write(s, node, elem_index, &lefts[depth]);
+        if (!node) {
+            return false; // a shared node could not be copied
+        }
+    }
+    elem_index = set_node_search(s, node, (void *)elem, &found);
+    if (!found) {
+        return false;
+    }
+    --s->size;
+    // sizes of nodes which rebalance are recomputed as they do
+    set_count_path(s, node, path, depth, -1);
+    size_t elem_size = s->elem_size;
+    char *key = set_node_key(s, node, elem_index);
+    if (copy_out) {
+        memcpy(copy_out, key, elem_size);
+    }
+    memmove(key, key + elem_size, (node->n_keys - elem_index - 1) * elem_size);
+    --node->n_keys;
+    // Separators equal to the erased element may remain above. They still
+    // bound their subtrees correctly, so are left alone.
+    set_rebalance(s, node, lefts, depth);
+    return true;
+}
+
+// Number of nodes to split `n_items` keys or children into, so that each gets
+// about `target` of them, but no fewer than `min` (unless there is only one)
+static size_t set_build_node_count(size_t n_items, size_t target,
+                                   size_t min) {
+    size_t n_nodes = (n_items + target - 1) / target;
+    if (n_nodes > 1 && n_items / n_nodes < min) {
+        n_nodes = n_items / min;
+    }
+    return n_nodes;
+}
+
+// `fill` of `capacity`, rounded and clamped to [min, capacity]
+static size_t set_build_target(double fill, size_t capacity, size_t min) {
+    size_t target = (size_t)(fill * capacity + 0.5);
+    if (target < min) {
+        return min;
+    }
+    return target > capacity ? capacity : target;
+}
+
+// Source of the elements set_build puts in the tree: copies the next `n` of
+// them to `dst`, and returns false if it cannot
+typedef bool (*set_build_source)(void *ctx, void *dst, size_t n);
+
+// Free the nodes of a level set_build was building: the first `n_built`
+// nodes of `level`, and the nodes of the level below from `first_left` to
+// `level_size`, which are not yet children of any of them. Returns false.
+static bool set_build_abort(set *s, set_node **level, void **level_mins,
+                            size_t n_built, size_t first_left,
+                            size_t level_size) {
+    for (size_t i = 0; i < n_built; ++i) {
+        set_tree_free(s, level[i]);
+    }
+    for (size_t i = first_left; i < level_size; ++i) {
+        set_tree_free(s, level[i]);
+    }
+    free(level);
+    free(level_mins);
+    return false;
+}
+
+// Replace the contents of `s` with `n` sorted elements taken from `source`,
+// as described for set_build_sorted. Returns false, leaving `s` empty, if
+// `source` fails or memory runs out.
+static bool set_build(set *s, size_t n, double fill, set_build_source source,
+                      void *ctx) {
+    set_free(s);
+    if (n == 0) {
+        return true;
+    }
+    size_t elem_size = s->elem_size;
+    size_t order = s->order;
+    // leaves: evenly spread elems, each leaf holding about `fill` of capacity
+    size_t n_nodes = set_build_node_count(n,
+            set_build_target(fill, order - 1, order / 2), order / 2);
+    // nodes of the level being built, and the first element under each
+    if (n_nodes > SIZE_MAX / sizeof(set_node *)) {
+        return false;
+    }
+    set_node **level = malloc(n_nodes * sizeof(set_node *));
+    void **level_mins = malloc(n_nodes * sizeof(void *));
+    if (!level || !level_mins) {
+        return set_build_abort(s, level, level_mins, 0, 0, 0);
+    }
+    for (size_t i = 0; i < n_nodes; ++i) {
+        size_t n_keys = n / n_nodes + (i < n % n_nodes);
+        set_node *leaf = set_node_init(s, NULL, NULL, n_keys, true);
+        if (!leaf || !source(ctx, set_node_key(s, leaf, 0), n_keys)) {
+            if (leaf) {
+                set_node_release(s, leaf);
+            }
+            return set_build_abort(s, level, level_mins, i, 0, 0);
+        }
+        level[i] = leaf;
+        level_mins[i] = set_node_key(s, leaf, 0);
+        if (i > 0) {
+            level[i - 1]->right_sibling = leaf;
+            memcpy(set_node_high_key(s, level[i - 1]), level_mins[i],
+                   elem_size);
+        }
+    }
+    // internal levels, bottom-up, until a single root remains. Each level
+    // overwrites the one below in place, since nodes never have fewer
+    // children than their index.
+    size_t child_target = set_build_target(fill, order, (order + 1) / 2);
+    size_t level_size = n_nodes;
+    while (level_size > 1) {
+        n_nodes = set_build_node_count(level_size, child_target,
+                                       (order + 1) / 2);
+        size_t first_child = 0;
+        for (size_t i = 0; i < n_nodes; ++i) {
+            size_t n_children = level_size / n_nodes
+                                + (i < level_size % n_nodes);
+            set_node *node = set_node_init(s, NULL, NULL, n_children - 1,
+                                           false);
+            if (!node) {
+                return set_build_abort(s, level, level_mins, i, first_child,
+                                       level_size);
+            }
+            for (size_t child = 0; child < n_children; ++child) {
+                set_put_child(s, node, child, level[first_child + child]);
+                if (child > 0) {
+                    memcpy(set_node_key(s, node, child - 1),
+                           level_mins[first_child + child], elem_size);
+                }
+            }
+            level_mins[i] = level_mins[first_child];
+            if (i > 0) {
+                level[i - 1]->right_sibling = node;
+                memcpy(set_node_high_key(s, level[i - 1]), level_mins[i],
+                       elem_size);
+            }
+            level[i] = node;
+            first_child += n_children;
+        }
+        level_size = n_nodes;
+    }
+    s->root = level[0];
+    s->size = n;
+    free(level);
+    free(level_mins);
+    return true;
+}
+
+// set_build_source reading an array
+typedef struct set_build_array {
+    const char *next;
+    size_t elem_size;
+} set_build_array;
+
+static bool set_build_from_array(void *ctx, void *dst, size_t n) {
+    set_build_array *array = ctx;
+    memcpy(dst, array->next, n * array->elem_size);
+    array->next += n * array->elem_size;
+    return true;
+}
+
+void set_build_sorted(set *s, const void *elems, size_t n, double fill) {
+    set_build_array array = {elems, s->elem_size};
+    set_build(s, n, fill, set_build_from_array, &array);
+}
+
+void set_track_ranks(set *s) {
+    s->counts_offset = set_align_up(s->children_offset
+                                    + s->order * sizeof(set_node *),
+                                    _Alignof(size_t));
+    s->node_size = s->counts_offset + s->order * sizeof(size_t);
+}
+
+size_t set_size(set *s) {
+    return s->size;
+}
+
+bool set_select(set *s, size_t k, void *out) {
+    if (k >= s->size) {
+        return false;
+    }
+    set_node *node = s->root;
+    if (s->counts_offset) {
+        // skip whole subtrees by their sizes
+        while (!node->is_leaf) {
+            size_t *counts = set_node_counts(s, node);
+            size_t child = 0;
+            while (k >= counts[child]) {
+                k -= counts[child];
+                ++child;
+            }
+            node = set_node_child(s, node, child);
+        }
+    }
+    else {
+        // skip whole leaves along the leaf chain
+        while (!node->is_leaf) {
+            node = set_node_child(s, node, 0);
+        }
+        while (k >= node->n_keys) {
+            k -= node->n_keys;
+            node = set_node_next(s, node);
+        }
+    }
+    memcpy(out, set_node_key(s, node, k), s->elem_size);
+    return true;
+}
+
+size_t set_rank(set *s, const void *elem) {
+    set_node *node = s->root;
+    if (!node) {
+        return 0;
+    }
+    bool found;
+    size_t rank = 0;
+    if (s->counts_offset) {
+        // add up the sizes of the subtrees left of the path to elem
+        while (!node->is_leaf) {
+            size_t child = set_node_search(s, node, (void *)elem, &found)
+                           + found;
+            size_t *counts = set_node_counts(s, node);
+            for (size_t left = 0; left < child; ++left) {
+                rank += counts[left];
+            }
+            node = set_node_child(s, node, child);
+        }
+        return rank + set_node_search(s, node, (void *)elem, &found);
+    }
+    // count leaves along the leaf chain up to elem's
+    set_iter it;
+    set_iter_seek(s, &it, elem);
+    while (!node->is_leaf) {
+        node = set_node_child(s, node, 0);
+    }
+    for (; node != it.leaf; node = set_node_next(s, node)) {
+        rank += node->n_keys;
+    }
+    return rank + it.index;
+}
+
+void set_iter_begin(set *s, set_iter *it) {
+    set_node *node = s->root;
+    while (node && !node->is_leaf) {
+        node = set_node_child(s, node, 0);
+    }
+    it->s = s;
+    it->leaf = node;
+    it->index = 0;
+}
+
+// Position `it` at the first element of `s` not less than `elem`, or if
+// `after`, at the first element greater than `elem`
+static void set_iter_seek_bound(set *s, set_iter *it, const void *elem,
+                                bool after) {
+    set_node *node = s->root;
+    bool found;
+    it->s = s;
+    it->leaf = node;
+    it->index = 0;
+    if (!node) {
+        return;
+    }
+    while (!node->is_leaf) {
+        size_t elem_index = set_node_search(s, node, (void *)elem, &found);
+        node = set_node_child(s, node, elem_index + found);
+    }
+    it->leaf = node;
+    it->index = set_node_search(s, node, (void *)elem, &found);
+    if (after) {
+        it->index += found;
+    }
+}
+
+void set_iter_seek(set *s, set_iter *it, const void *elem) {
+    set_iter_seek_bound(s, it, elem, false);
+}
+
+void *set_iter_next(set_iter *it) {
+    // step along the leaf chain past the end of the current leaf
+    while (it->leaf && it->index >= it->leaf->n_keys) {
+        it->leaf = set_node_next(it->s, it->leaf);
+        it->index = 0;
+    }
+    if (!it->leaf) {
+        return NULL;
+    }
+    return set_node_key(it->s, it->leaf, it->index++);
+}
+
+// Copy the element at `it`, if any, to `copy_out`, and return whether there
+// was one
+static bool set_iter_copy(set_iter *it, void *copy_out) {
+    void *elem = set_iter_next(it);
+    if (elem && copy_out) {
+        memcpy(copy_out, elem, it->s->elem_size);
+    }
+    return elem != NULL;
+}
+
+bool set_lower_bound(set *s, const void *elem, void *copy_out) {
+    set_iter it;
+    set_iter_seek_bound(s, &it, elem, false);
+    return set_iter_copy(&it, copy_out);
+}
+
+bool set_upper_bound(set *s, const void *elem, void *copy_out) {
+    set_iter it;
+    set_iter_seek_bound(s, &it, elem, true);
+    return set_iter_copy(&it, copy_out);
+}
+
+size_t set_range(set *s, const void *low, const void *high,
+        void (*func)(void *, void *), void *extra) {
+    set_iter it;
+    if (low) {
+        set_iter_seek(s, &it, low);
+    }
+    else {
+        set_iter_begin(s, &it);
+    }
+    size_t n_visited = 0;
+    void *elem;
+    while ((elem = set_iter_next(&it))
+           && (!high || set_less(s, elem, (void *)high))) {
+        func(elem, extra);
+        ++n_visited;
+    }
+    return n_visited;
+}
+
+// which elements set_combine keeps: those in only the first set, only the
+// second, or both
+enum {
+    SET_KEEP_A = 1,
+    SET_KEEP_B = 2,
+    SET_KEEP_BOTH = 4,
+};
+
+// Merge the elements of `a` and `b`, in order, into a buffer, keeping them
+// according to `keep`, and then bulk-load `dst` with the result. Elements in
+// both sets are taken from `a`. O(n + m), since both leaf chains are walked
+// once and set_build_sorted is linear.
+static size_t set_combine(set *dst, set *a, set *b, unsigned keep) {
+    size_t elem_size = a->elem_size;
+    size_t capacity = (keep & SET_KEEP_A ? a->size : 0)
+                      + (keep & SET_KEEP_B ? b->size : 0);
+    if (keep == SET_KEEP_BOTH) {
+        capacity = a->size < b->size ? a->size : b->size;
+    }
+    char *out = malloc(capacity ? capacity * elem_size : 1);
+    if (!out) {
+        return SIZE_MAX;
+    }
+    size_t n = 0;
+    set_iter it_a, it_b;
+    set_iter_begin(a, &it_a);
+    set_iter_begin(b, &it_b);
+    char *elem_a = set_iter_next(&it_a);
+    char *elem_b = set_iter_next(&it_b);
+    while (elem_a && elem_b) {
+        int order = set_compare(a, elem_a, elem_b);
+        if (order < 0) {
+            if (keep & SET_KEEP_A) {
+                memcpy(out + n++ * elem_size, elem_a, elem_size);
+            }
+            elem_a = set_iter_next(&it_a);
+        }
+        else if (order > 0) {
+            if (keep & SET_KEEP_B) {
+                memcpy(out + n++ * elem_size, elem_b, elem_size);
+            }
+            elem_b = set_iter_next(&it_b);
+        }
+        else {
+            if (keep & SET_KEEP_BOTH) {
+                memcpy(out + n++ * elem_size, elem_a, elem_size);
+            }
+            elem_a = set_iter_next(&it_a);
+            elem_b = set_iter_next(&it_b);
+        }
+    }
+    // whichever set is left over has no counterparts in the other
+    for (; elem_a && keep & SET_KEEP_A; elem_a = set_iter_next(&it_a)) {
+        memcpy(out + n++ * elem_size, elem_a, elem_size);
+    }
+    for (; elem_b && keep & SET_KEEP_B; elem_b = set_iter_next(&it_b)) {
+        memcpy(out + n++ * elem_size, elem_b, elem_size);
+    }
+    // a and b are fully read, so dst may be either of them
+    set_build_array array = {out, elem_size};
+    bool built = set_build(dst, n, 1, set_build_from_array, &array);
+    free(out);
+    return built ? n : SIZE_MAX;
+}
+
+size_t set_union(set *dst, set *a, set *b) {
+    return set_combine(dst, a, b, SET_KEEP_A | SET_KEEP_B | SET_KEEP_BOTH);
+}
+
+size_t set_intersect(set *dst, set *a, set *b) {
+    return set_combine(dst, a, b, SET_KEEP_BOTH);
+}
+
+size_t set_difference(set *dst, set *a, set *b) {
+    return set_combine(dst, a, b, SET_KEEP_A);
+}
+
+size_t set_symdiff(set *dst, set *a, set *b) {
+    return set_combine(dst, a, b, SET_KEEP_A | SET_KEEP_B);
+}
+
+void set_tree_map(set *s, set_node *node,
+        void (*func)(void *, void *), void *extra) {
+    if (node->is_leaf) {
+        // apply func to data
+        for (size_t key = 0; key < node->n_keys; ++key) {
+            func(set_node_key(s, node, key), extra);
+        }
+        return;
+    }
+    // recursively apply func to children
+    for (size_t child = 0; child < (size_t)node->n_keys + 1; ++child) {
+        set_tree_map(s, set_node_child(s, node, child), func, extra);
+    }
+}
+
+void set_map(set *s, void (*func)(void *, void *), void *extra) {
+    if (!set_unshare_all(s)) {
+        return;
+    }
+    if (s->root) {
+        set_tree_map(s, s->root, func, extra);
+    }
+    else if (s->frozen) {
+        for (size_t i = set_frozen_next(0, s->size); i;
+             i = set_frozen_next(i, s->size)) {
+            func((char *)s->frozen + i * s->elem_size, extra);
+        }
+    }
+}
+
+// set_map_parallel aims for this many subtrees per thread, so that stealing
+// can even out subtrees of different sizes and costs
+#define SET_MAP_SUBTREES_PER_THREAD 8
+
+// Subtrees one thread of set_map_parallel has yet to map, as indices
+// `next << 32 | end` into the shared array of subtrees. The owner claims from
+// the front and thieves take the back half, each with one compare-and-swap.
+typedef struct set_map_worker {
+    _Alignas(64) _Atomic uint64_t range; // own cache line, to avoid false sharing
+} set_map_worker;
+
+typedef struct set_map_job {
+    set *s;
+    set_node **subtrees;
+    void (*func)(void *, void *);
+    void **extra;
+    set_map_worker *workers;
+    size_t n_threads;
+} set_map_job;
+
+typedef struct set_map_thread {
+    set_map_job *job;
+    size_t index;
+} set_map_thread;
+
+// claim the first subtree left in `range`, returning false if it is empty
+static bool set_map_claim(_Atomic uint64_t *range, size_t *subtree) {
+    uint64_t old = atomic_load(range);
+    uint64_t next, end;
+    do {
+        next = old >> 32;
+        end = old & UINT32_MAX;
+        if (next >= end) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(range, &old,
+                                           (next + 1) << 32 | end));
+    *subtree = next;
+    return true;
+}
+
+// move the back half of `victim`'s subtrees to `thief`, whose range is empty
+static bool set_map_steal(_Atomic uint64_t *victim, _Atomic uint64_t *thief) {
+    uint64_t old = atomic_load(victim);
+    uint64_t next, mid, end;
+    do {
+        next = old >> 32;
+        end = old & UINT32_MAX;
+        if (next >= end) {
+            return false;
+        }
+        mid = next + (end - next) / 2;
+    } while (!atomic_compare_exchange_weak(victim, &old, next << 32 | mid));
+    atomic_store(thief, mid << 32 | end);
+    return true;
+}
+
+static void *set_map_run(void *arg) {
+    set_map_thread *thread = arg;
+    set_map_job *job = thread->job;
+    _Atomic uint64_t *own = &job->workers[thread->index].range;
+    void *extra = job->extra ? job->extra[thread->index] : NULL;
+    for (;;) {
+        size_t subtree;
+        while (set_map_claim(own, &subtree)) {
+            set_tree_map(job->s, job->subtrees[subtree], job->func, extra);
+        }
+        // out of work: steal from the others in turn, and stop once they are
+        // all empty. Work is never added, so this cannot miss any.
+        bool stole = false;
+        for (size_t i = 1; i < job->n_threads && !stole; ++i) {
+            size_t victim = (thread->index + i) % job->n_threads;
+            stole = set_map_steal(&job->workers[victim].range, own);
+        }
+        if (!stole) {
+            return NULL;
+        }
+    }
+}
+
+void set_map_parallel(set *s, void (*func)(void *, void *), void **extra,
+                      size_t n_threads) {
+    if (!s->root) {
+        return;
+    }
+    if (n_threads == 0) {
+        n_threads = 1;
+    }
+    if (!set_unshare_all(s)) {
+        return;
+    }
+    // the shallowest level with enough nodes supplies the subtrees. Levels
+    // are expanded through child arrays, not sibling links, so that this
+    // also works on snapshots.
+    size_t target = n_threads * SET_MAP_SUBTREES_PER_THREAD;
+    set_node **subtrees = malloc(sizeof(set_node *));
+    if (!subtrees) {
+        set_tree_map(s, s->root, func, extra ? extra[0] : NULL);
+        return;
+    }
+    subtrees[0] = s->root;
+    size_t n_subtrees = 1;
+    while (n_subtrees < target && !subtrees[0]->is_leaf) {
+        size_t n_children = 0;
+        for (size_t i = 0; i < n_subtrees; ++i) {
+            n_children += subtrees[i]->n_keys + 1;
+        }
+        set_node **children = malloc(n_children * sizeof(set_node *));
+        if (!children) {
+            break; // make do with the subtrees of this level
+        }
+        n_children = 0;
+        for (size_t i = 0; i < n_subtrees; ++i) {
+            for (size_t child = 0; child < (size_t)subtrees[i]->n_keys + 1;
+                 ++child) {
+                children[n_children++] = set_node_child(s, subtrees[i], child);
+            }
+        }
+        free(subtrees);
+        subtrees = children;
+        n_subtrees = n_children;
+    }
+    if (n_threads > n_subtrees) {
+        n_threads = n_subtrees;
+    }
+    set_map_worker *workers = aligned_alloc(_Alignof(set_map_worker),
+                                            n_threads * sizeof(set_map_worker));
+    set_map_thread *threads = malloc(n_threads * sizeof(set_map_thread));
+    pthread_t *ids = malloc(n_threads * sizeof(pthread_t));
+    bool *started = calloc(n_threads, sizeof(bool));
+    if (!workers || !threads || !ids || !started) {
+        // map on this thread alone
+        free(started);
+        free(ids);
+        free(threads);
+        free(workers);
+        free(subtrees);
+        set_tree_map(s, s->root, func, extra ? extra[0] : NULL);
+        return;
+    }
+    size_t i;
+    set_map_job job = {s, subtrees, func, extra, workers, n_threads};
+    // each thread starts with a contiguous run of subtrees
+    for (i = 0; i < n_threads; ++i) {
+        uint64_t next = n_subtrees * i / n_threads;
+        uint64_t end = n_subtrees * (i + 1) / n_threads;
+        atomic_init(&workers[i].range, next << 32 | end);
+        threads[i] = (set_map_thread){&job, i};
+    }
+    // the calling thread is thread 0. If a thread cannot be started, the
+    // others steal its subtrees.
+    for (i = 1; i < n_threads; ++i) {
+        started[i] = pthread_create(&ids[i], NULL, set_map_run,
+                                    &threads[i]) == 0;
+    }
+    set_map_run(&threads[0]);
+    for (i = 1; i < n_threads; ++i) {
+        if (started[i]) {
+            pthread_join(ids[i], NULL);
+        }
+    }
+    free(started);
+    free(ids);
+    free(threads);
+    free(workers);
+    free(subtrees);
+}
+
+/* Images. The first page holds a `set_image_header`; the nodes follow, one
+ * level after another from the root, each level starting on a new page. Within
+ * a level, nodes are packed in order without straddling pages (nodes larger
+ * than a page start on one), so node `i` of a level is found by arithmetic,
+ * and a node's children and right sibling can be given their offsets before
+ * they are written. Links are stored as those offsets, or 0 for none; parents
+ * are not stored.
+ */
+
+#define SET_IMAGE_PAGE 4096
+#define SET_IMAGE_VERSION 2
+#define SET_IMAGE_BYTE_ORDER 0x01020304u
+
+typedef struct set_image_header {
+    char magic[8]; // "SETIMAGE"
+    uint32_t version; // SET_IMAGE_VERSION
+    uint32_t byte_order; // SET_IMAGE_BYTE_ORDER, as stored by the writer
+    uint64_t pointer_size;
+    uint64_t image_size; // bytes, including this header
+    uint64_t root; // offset of the root, or 0 if the set is empty
+    uint64_t size; // number of elements
+    uint64_t elem_size;
+    uint64_t order;
+    uint64_t key_kind;
+    // node layout, which must match what set_init computes on the reader
+    uint64_t keys_offset;
+    uint64_t children_offset;
+    uint64_t counts_offset;
+    uint64_t leaf_size;
+    uint64_t node_size;
+} set_image_header;
+
+// offset of node `index` of a level of nodes of `size` bytes, starting at
+// `base`
+static uint64_t set_image_slot(size_t size, uint64_t base, size_t index) {
+    size_t stride = set_align_up(size, _Alignof(max_align_t));
+    size_t unit = set_align_up(stride, SET_IMAGE_PAGE);
+    size_t per_unit = unit / stride;
+    return base + index / per_unit * unit + index % per_unit * stride;
+}
+
+// write zeros to `out` from `*pos` up to `end`
+static bool set_image_pad(FILE *out, uint64_t *pos, uint64_t end) {
+    static const char zeros[SET_IMAGE_PAGE];
+    while (*pos < end) {
+        size_t n = end - *pos < sizeof(zeros) ? end - *pos : sizeof(zeros);
+        if (fwrite(zeros, 1, n, out) != n) {
+            return false;
+        }
+        *pos += n;
+    }
+    return true;
+}
+
+bool set_image_write(set *s, FILE *out) {
+    set_image_header header = {
+        .magic = "SETIMAGE",
+        .version = SET_IMAGE_VERSION,
+        .byte_order = SET_IMAGE_BYTE_ORDER,
+        .pointer_size = sizeof(void *),
+        .size = s->size,
+        .elem_size = s->elem_size,
+        .order = s->order,
+        .key_kind = s->key_kind,
+        .keys_offset = s->keys_offset,
+        .children_offset = s->children_offset,
+        .counts_offset = s->counts_offset,
+        .leaf_size = s->leaf_size,
+        .node_size = s->node_size,
+    };
+    // Gather the internal levels through child arrays (which snapshots own,
+    // unlike sibling links), and count the leaves. Internal nodes are a small
+    // fraction of the tree, and the leaves are written straight from the
+    // child arrays of the level above them.
+    set_node **levels[SET_MAX_DEPTH];
+    size_t counts[SET_MAX_DEPTH];
+    uint64_t bases[SET_MAX_DEPTH];
+    size_t height = 0;
+    if (s->root) {
+        levels[0] = malloc(sizeof(set_node *));
+        levels[0][0] = s->root;
+        counts[0] = 1;
+        height = 1;
+        while (!levels[height - 1][0]->is_leaf) {
+            set_node **level = levels[height - 1];
+            size_t n_children = 0;
+            for (size_t i = 0; i < counts[height - 1]; ++i) {
+                n_children += level[i]->n_keys + 1;
+            }
+            bool leaves = set_node_child(s, level[0], 0)->is_leaf;
+            set_node **children = NULL;
+            if (!leaves) {
+                children = malloc(n_children * sizeof(set_node *));
+                n_children = 0;
+                for (size_t i = 0; i < counts[height - 1]; ++i) {
+                    for (size_t child = 0; child < (size_t)level[i]->n_keys + 1;
+                         ++child) {
+                        children[n_children++] = set_node_child(s, level[i],
+                                                                child);
+                    }
+                }
+            }
+            levels[height] = children;
+            counts[height] = n_children;
+            ++height;
+            if (leaves) {
+                break;
+            }
+        }
+    }
+    uint64_t end = SET_IMAGE_PAGE;
+    for (size_t depth = 0; depth < height; ++depth) {
+        size_t size = depth + 1 < height ? s->node_size : s->leaf_size;
+        bases[depth] = end;
+        end = set_align_up(set_image_slot(size, end, counts[depth] - 1)
+                           + size, SET_IMAGE_PAGE);
+    }
+    header.root = height ? bases[0] : 0;
+    header.image_size = end;
+
+    uint64_t pos = sizeof(header);
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    set_node *buffer = malloc(s->node_size);
+    for (size_t depth = 0; depth < height && ok; ++depth) {
+        bool leaves = depth + 1 == height;
+        size_t size = leaves ? s->leaf_size : s->node_size;
+        size_t child_size = depth + 2 < height ? s->node_size : s->leaf_size;
+        size_t n_children = 0;
+        // leaves are the children of the level above, if there is one
+        set_node **parents = leaves && depth > 0 ? levels[depth - 1] : NULL;
+        size_t parent = 0, child = 0;
+        for (size_t i = 0; i < counts[depth] && ok; ++i) {
+            set_node *node;
+            if (parents) {
+                if (child > parents[parent]->n_keys) {
+                    ++parent;
+                    child = 0;
+                }
+                node = set_node_child(s, parents[parent], child++);
+            }
+            else {
+                node = levels[depth][i];
+            }
+            memcpy(buffer, node, size);
+            buffer->parent = NULL;
+            buffer->right_sibling = i + 1 < counts[depth]
+                ? (set_node *)(uintptr_t)set_image_slot(size, bases[depth],
+                                                        i + 1)
+                : NULL;
+            atomic_init(&buffer->version, 0);
+            atomic_init(&buffer->refs, 1);
+            if (!leaves) {
+                set_node **children = set_node_children(s, buffer);
+                for (size_t c = 0; c < (size_t)node->n_keys + 1; ++c) {
+                    children[c] = (set_node *)(uintptr_t)set_image_slot(
+                        child_size, bases[depth + 1], n_children++);
+                }
+            }
+            ok = set_image_pad(out, &pos,
+                               set_image_slot(size, bases[depth], i))
+                 && fwrite(buffer, size, 1, out) == 1;
+            pos += size;
+        }
+    }
+    ok = ok && set_image_pad(out, &pos, end) && fflush(out) == 0;
+    free(buffer);
+    for (size_t depth = 0; depth < height; ++depth) {
+        free(levels[depth]);
+    }
+    return ok;
+}
+
+bool set_image_open(set *s, const void *image, size_t size, set_less_t less) {
+    const set_image_header *header = image;
+    if (size < sizeof(*header) || memcmp(header->magic, "SETIMAGE", 8) != 0
+        || header->version != SET_IMAGE_VERSION
+        || header->byte_order != SET_IMAGE_BYTE_ORDER
+        || header->pointer_size != sizeof(void *)
+        || header->image_size > size || header->order < 3
+        || header->order > UINT16_MAX) {
+        return false;
+    }
+    uint16_t order = header->order;
+    switch (header->key_kind) {
+    case SET_KEY_GENERIC:
+        set_init(s, order, less, header->elem_size);
+        break;
+    case SET_KEY_I32:
+        set_i32_init(s, order);
+        break;
+    case SET_KEY_U32:
+        set_u32_init(s, order);
+        break;
+    case SET_KEY_I64:
+        set_i64_init(s, order);
+        break;
+    case SET_KEY_U64:
+        set_u64_init(s, order);
+        break;
+    default:
+        return false;
+    }
+    if (header->counts_offset) {
+        set_track_ranks(s);
+    }
+    // the nodes are used as they are, so must be laid out as this build would
+    if (s->elem_size != header->elem_size
+        || s->keys_offset != header->keys_offset
+        || s->children_offset != header->children_offset
+        || s->counts_offset != header->counts_offset
+        || s->leaf_size != header->leaf_size
+        || s->node_size != header->node_size) {
+        return false;
+    }
+    // the root must lie within the image, and a set with elements needs one.
+    // The other nodes are trusted, as checking them would take O(n)
+    if (header->root != 0
+        ? header->root < sizeof(*header)
+          || header->image_size < header->leaf_size
+          || header->root > header->image_size - header->leaf_size
+        : header->size != 0) {
+        return false;
+    }
+    s->image = (uintptr_t)image;
+    s->root = header->root ? (set_node *)(s->image + header->root) : NULL;
+    s->size = header->size;
+    return true;
+}
+
+// Copy the subtree of `s` at `node` out of its image, under `parent`, and
+// return the copy. `lefts[depth]` is the last node copied on its level, which
+// the copy is linked to as its right sibling.
+static set_node *set_image_copy(set *s, set_node *node, set_node *parent,
+                                set_node **lefts, size_t depth) {
+    size_t size = node->is_leaf ? s->leaf_size : s->node_size;
+    set_node *copy = set_alloc(s, size);
+    memcpy(copy, node, size);
+    copy->parent = parent;
+    copy->right_sibling = NULL;
+    if (lefts[depth]) {
+        lefts[depth]->right_sibling = copy;
+    }
+    lefts[depth] = copy;
+    if (!node->is_leaf) {
+        for (size_t child = 0; child < (size_t)node->n_keys + 1; ++child) {
+            set_node_children(s, copy)[child] = set_image_copy(
+                s, set_node_child(s, node, child), copy, lefts, depth + 1);
+        }
+    }
+    return copy;
+}
+
+void set_image_promote(set *s) {
+    set_node *root = NULL;
+    if (s->root) {
+        set_node *lefts[SET_MAX_DEPTH] = {0};
+        root = set_image_copy(s, s->root, NULL, lefts, 0);
+    }
+    s->image = 0;
+    s->root = root;
+}
+
+/* Streams. After an 8 byte magic string come varints (LEB128) giving the
+ * format version, element size, key kind and number of elements, then the
+ * elements in increasing order, in chunks. Each chunk is a varint element
+ * count (at most SET_STREAM_CHUNK), a varint byte count and that many bytes of
+ * elements. A count of 0 ends the stream. Elements of generic sets are stored
+ * as they are in memory; those of typed sets as varint differences from the
+ * previous element of the chunk (the first from 0), after mapping them to
+ * unsigned integers of the same order.
+ */
+
+#define SET_STREAM_VERSION 1
+#define SET_STREAM_CHUNK 4096
+#define SET_VARINT_MAX 10 // bytes in the longest varint of a uint64_t
+
+static const char set_stream_magic[8] = "SETSTRM";
+
+// append `value` to `buffer` as a varint, and return its length
+static size_t set_varint_put(unsigned char *buffer, uint64_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        buffer[length++] = (unsigned char)value | 0x80;
+        value >>= 7;
+    }
+    buffer[length++] = (unsigned char)value;
+    return length;
+}
+
+// decode the varint in `buffer`, of `size` bytes, to `*value`, and return its
+// length, or 0 if `buffer` does not hold a whole valid one
+static size_t set_varint_get(const unsigned char *buffer, size_t size,
+                             uint64_t *value) {
+    *value = 0;
+    for (size_t length = 0; length < size && length < SET_VARINT_MAX;
+         ++length) {
+        *value |= (uint64_t)(buffer[length] & 0x7f) << (7 * length);
+        if (!(buffer[length] & 0x80)) {
+            return length + 1;
+        }
+    }
+    return 0;
+}
+
+static bool set_varint_write(FILE *out, uint64_t value) {
+    unsigned char buffer[SET_VARINT_MAX];
+    size_t length = set_varint_put(buffer, value);
+    return fwrite(buffer, 1, length, out) == length;
+}
+
+static bool set_varint_read(FILE *in, uint64_t *value) {
+    unsigned char buffer[SET_VARINT_MAX];
+    size_t length = 0;
+    int byte;
+    do {
+        if (length == SET_VARINT_MAX || (byte = getc(in)) == EOF) {
+            return false;
+        }
+        buffer[length++] = (unsigned char)byte;
+    } while (byte & 0x80);
+    return set_varint_get(buffer, length, value) == length;
+}
+
+// `elem`, of a typed set of key kind `kind`, as an unsigned integer, with the
+// sign bit of signed kinds flipped so that the order is kept
+static uint64_t set_stream_to_uint(uint8_t kind, const void *elem) {
+    switch (kind) {
+    case SET_KEY_I32:
+        return *(const uint32_t *)elem ^ UINT32_C(0x80000000);
+    case SET_KEY_U32:
+        return *(const uint32_t *)elem;
+    case SET_KEY_I64:
+        return *(const uint64_t *)elem ^ UINT64_C(0x8000000000000000);
+    default:
+        return *(const uint64_t *)elem;
+    }
+}
+
+// inverse of set_stream_to_uint
+static void set_stream_from_uint(uint8_t kind, void *elem, uint64_t value) {
+    switch (kind) {
+    case SET_KEY_I32:
+        *(uint32_t *)elem = (uint32_t)value ^ UINT32_C(0x80000000);
+        break;
+    case SET_KEY_U32:
+        *(uint32_t *)elem = (uint32_t)value;
+        break;
+    case SET_KEY_I64:
+        *(uint64_t *)elem = value ^ UINT64_C(0x8000000000000000);
+        break;
+    default:
+        *(uint64_t *)elem = value;
+    }
+}
+
+// largest number of bytes a chunk of `s` may take
+static size_t set_stream_chunk_size(const set *s) {
+    return SET_STREAM_CHUNK * (s->key_kind == SET_KEY_GENERIC
+                               ? s->elem_size : SET_VARINT_MAX);
+}
+
+// chunk being encoded by set_write
+typedef struct set_writer {
+    set *s;
+    FILE *out;
+    unsigned char *buffer;
+    size_t n_elems;
+    size_t n_bytes;
+    uint64_t last; // last element encoded, for typed sets
+    bool ok;
+} set_writer;
+
+static void set_writer_flush(set_writer *w) {
+    if (w->n_elems) {
+        w->ok = w->ok && set_varint_write(w->out, w->n_elems)
+                && set_varint_write(w->out, w->n_bytes)
+                && fwrite(w->buffer, 1, w->n_bytes, w->out) == w->n_bytes;
+    }
+    w->n_elems = 0;
+    w->n_bytes = 0;
+    w->last = 0;
+}
+
+// encode the elements under `node`, in order. The walk follows child arrays,
+// so works on snapshots and images too.
+static void set_writer_tree(set_writer *w, set_node *node) {
+    set *s = w->s;
+    if (!node->is_leaf) {
+        for (size_t child = 0; child < (size_t)node->n_keys + 1 && w->ok;
+             ++child) {
+            set_writer_tree(w, set_node_child(s, node, child));
+        }
+        return;
+    }
+    for (size_t key = 0; key < node->n_keys; ++key) {
+        void *elem = set_node_key(s, node, key);
+        if (s->key_kind == SET_KEY_GENERIC) {
+            memcpy(w->buffer + w->n_bytes, elem, s->elem_size);
+            w->n_bytes += s->elem_size;
+        }
+        else {
+            uint64_t value = set_stream_to_uint(s->key_kind, elem);
+            w->n_bytes += set_varint_put(w->buffer + w->n_bytes,
+                                         value - w->last);
+            w->last = value;
+        }
+        if (++w->n_elems == SET_STREAM_CHUNK) {
+            set_writer_flush(w);
+        }
+    }
+}
+
+bool set_write(set *s, FILE *out) {
+    set_writer w = {s, out, malloc(set_stream_chunk_size(s)), 0, 0, 0, true};
+    w.ok = fwrite(set_stream_magic, sizeof(set_stream_magic), 1, out) == 1
+           && set_varint_write(out, SET_STREAM_VERSION)
+           && set_varint_write(out, s->elem_size)
+           && set_varint_write(out, s->key_kind)
+           && set_varint_write(out, s->size);
+    if (s->root && w.ok) {
+        set_writer_tree(&w, s->root);
+    }
+    set_writer_flush(&w);
+    free(w.buffer);
+    return w.ok && set_varint_write(out, 0) && fflush(out) == 0;
+}
+
+// chunks being decoded by set_read; a set_build_source
+typedef struct set_reader {
+    set *s;
+    FILE *in;
+    unsigned char *buffer;
+    size_t n_elems; // left in the current chunk
+    size_t n_bytes; // of the current chunk
+    size_t pos; // in buffer
+    uint64_t base; // last element decoded from the chunk, for typed sets
+    void *last; // last element decoded, or NULL at first
+} set_reader;
+
+// read the next chunk into `r`. Returns false at the end of the stream, or if
+// it cannot be read.
+static bool set_reader_chunk(set_reader *r) {
+    uint64_t n_elems, n_bytes;
+    if (!set_varint_read(r->in, &n_elems) || n_elems == 0
+        || n_elems > SET_STREAM_CHUNK || !set_varint_read(r->in, &n_bytes)
+        || n_bytes > set_stream_chunk_size(r->s)
+        || fread(r->buffer, 1, n_bytes, r->in) != n_bytes) {
+        return false;
+    }
+    r->n_elems = n_elems;
+    r->n_bytes = n_bytes;
+    r->pos = 0;
+    r->base = 0;
+    return true;
+}
+
+static bool set_reader_source(void *ctx, void *dst, size_t n) {
+    set_reader *r = ctx;
+    set *s = r->s;
+    for (char *elem = dst; n > 0; --n, elem += s->elem_size) {
+        if (r->n_elems == 0 && !set_reader_chunk(r)) {
+            return false;
+        }
+        --r->n_elems;
+        if (s->key_kind == SET_KEY_GENERIC) {
+            if (r->n_bytes - r->pos < s->elem_size) {
+                return false;
+            }
+            memcpy(elem, r->buffer + r->pos, s->elem_size);
+            r->pos += s->elem_size;
+            if (r->last && !set_less(s, r->last, elem)) {
+                return false;
+            }
+        }
+        else {
+            uint64_t delta;
+            size_t length = set_varint_get(r->buffer + r->pos,
+                                           r->n_bytes - r->pos, &delta);
+            uint64_t value = r->base + delta;
+            if (length == 0 || value < r->base
+                || (r->last && value <= set_stream_to_uint(s->key_kind,
+                                                           r->last))) {
+                return false;
+            }
+            set_stream_from_uint(s->key_kind, elem, value);
+            r->base = value;
+            r->pos += length;
+        }
+        if (r->n_elems == 0 && r->pos != r->n_bytes) {
+            return false;
+        }
+        r->last = elem;
+    }
+    return true;
+}
+
+bool set_read(set *s, FILE *in) {
+    char magic[sizeof(set_stream_magic)];
+    uint64_t version, elem_size, key_kind, size;
+    if (fread(magic, sizeof(magic), 1, in) != 1
+        || memcmp(magic, set_stream_magic, sizeof(magic)) != 0
+        || !set_varint_read(in, &version) || version != SET_STREAM_VERSION
+        || !set_varint_read(in, &elem_size) || elem_size != s->elem_size
+        || !set_varint_read(in, &key_kind) || key_kind != s->key_kind
+        || !set_varint_read(in, &size)
+        || size > SIZE_MAX / s->elem_size) {
+        set_free(s);
+        return false;
+    }
+    set_reader r = {s, in, malloc(set_stream_chunk_size(s)), 0, 0, 0, 0, NULL};
+    uint64_t end;
+    bool ok = r.buffer && set_build(s, size, 1, set_reader_source, &r)
+              && r.n_elems == 0 && set_varint_read(in, &end) && end == 0;
+    free(r.buffer);
+    if (!ok) {
+        set_free(s);
+    }
+    return ok;
+}
+
+// Store the elements at `it` in the subtree at index `i` of the Eytzinger
+// array `keys` of `s`, in order
+static void set_freeze_subtree(set *s, set_iter *it, char *keys, size_t i) {
+    if (i > s->size) {
+        return;
+    }
+    set_freeze_subtree(s, it, keys, 2 * i);
+    memcpy(keys + i * s->elem_size, set_iter_next(it), s->elem_size);
+    set_freeze_subtree(s, it, keys, 2 * i + 1);
+}
+
+bool set_freeze(set *s) {
+    if (s->frozen) {
+        return true;
+    }
+    size_t n = s->size;
+    // index 0 is unused, and rounding up to whole cache lines keeps the size
+    // a multiple of the alignment, as aligned_alloc requires
+    char *keys = aligned_alloc(64, set_align_up((n + 1) * s->elem_size, 64));
+    if (!keys) {
+        return false;
+    }
+    set_iter it;
+    set_iter_begin(s, &it);
+    set_freeze_subtree(s, &it, keys, 1);
+    set_free(s);
+    s->frozen = keys;
+    s->size = n;
+    return true;
+}
+
+// set_build_source reading a frozen set in order
+typedef struct set_thaw_source {
+    const char *keys;
+    size_t elem_size;
+    size_t n;
+    size_t index; // of the last element read, or 0 at first
+} set_thaw_source;
+
+static bool set_thaw_next(void *ctx, void *dst, size_t n) {
+    set_thaw_source *source = ctx;
+    for (char *elem = dst; n > 0; --n, elem += source->elem_size) {
+        source->index = set_frozen_next(source->index, source->n);
+        memcpy(elem, source->keys + source->index * source->elem_size,
+               source->elem_size);
+    }
+    return true;
+}
+
+bool set_thaw(set *s) {
+    if (!s->frozen) {
+        return true;
+    }
+    set_thaw_source source = {s->frozen, s->elem_size, s->size, 0};
+    // set_build frees the frozen array, unless it is detached first
+    s->frozen = NULL;
+    if (!set_build(s, source.n, 1, set_thaw_next, &source)) {
+        // set_build left s empty; stay frozen
+        s->frozen = (void *)source.keys;
+        s->size = source.n;
+        return false;
+    }
+    free((void *)source.keys);
+    return true;
+}
+
+bool set_stats(set *s, set_stats_t *out) {
+#ifdef SET_STATS
+    *out = s->stats;
+    return true;
+#else
+    (void)s;
+    memset(out, 0, sizeof(*out));
+    return false;
+#endif
+}
+
+void set_stats_reset(set *s) {
+#ifdef SET_STATS
+    memset(&s->stats, 0, sizeof(s->stats));
+#else
+    (void)s;
+#endif
+}
+
+uint64_t set_latency_percentile(const set_latency *latency,
+                                double percentile) {
+    if (latency->count == 0) {
+        return 0;
+    }
+    double rank = percentile / 100 * latency->count;
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < SET_LATENCY_BUCKETS; ++bucket) {
+        seen += latency->buckets[bucket];
+        if (seen > 0 && seen >= rank) {
+            uint64_t max = set_latency_bucket_max(bucket);
+            return max < latency->max_ns ? max : latency->max_ns;
+        }
+    }
+    return latency->max_ns;
+}
+
+// Add the subtree at `node`, on level `depth`, to `out`. `*prev` is the leaf
+// before the subtree's first one, or NULL.
+static void set_inspect_tree(set *s, set_node *node, size_t depth,
+                             set_node **prev, set_report *out) {
+    size_t max_keys = s->order - 1;
+    size_t bucket = node->n_keys * 10 / max_keys;
+    bucket = bucket < 10 ? bucket : 9;
+    ++out->level_nodes[depth];
+    ++out->nodes;
+    if (node->is_leaf) {
+        out->height = depth + 1;
+        ++out->leaves;
+        ++out->leaf_fill[bucket];
+        out->mean_leaf_fill += (double)node->n_keys / max_keys;
+        out->alloc_bytes += set_node_alloc_size(s, s->leaf_size);
+        out->leaf_slack_bytes += (max_keys - node->n_keys) * s->elem_size;
+        if (*prev) {
+            uintptr_t page = (uintptr_t)*prev / 4096;
+            uintptr_t next = (uintptr_t)node;
+            out->leaf_breaks += next < (uintptr_t)*prev
+                                || next / 4096 > page + 1;
+        }
+        *prev = node;
+        return;
+    }
+    ++out->internal_fill[bucket];
+    out->mean_internal_fill += (double)node->n_keys / max_keys;
+    out->alloc_bytes += set_node_alloc_size(s, s->node_size);
+    for (size_t child = 0; child < (size_t)node->n_keys + 1; ++child) {
+        set_inspect_tree(s, set_node_child(s, node, child), depth + 1, prev,
+                         out);
+    }
+}
+
+void set_inspect(set *s, set_report *out) {
+    memset(out, 0, sizeof(*out));
+    out->key_bytes = s->size * s->elem_size;
+    if (s->frozen) {
+        out->alloc_bytes = set_align_up((s->size + 1) * s->elem_size, 64);
+        return;
+    }
+    if (!s->root) {
+        return;
+    }
+    set_node *prev = NULL;
+    set_inspect_tree(s, s->root, 0, &prev, out);
+    out->mean_leaf_fill /= out->leaves;
+    if (out->nodes > out->leaves) {
+        out->mean_internal_fill /= out->nodes - out->leaves;
+    }
 }
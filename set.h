@@ -2,23 +2,286 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+
+/* Orders above this use binary search within nodes; orders up to it scan keys
+ * linearly. See bench/search.c for how to measure the crossover.
+ */
+#ifndef SET_BINARY_SEARCH_ORDER
+#define SET_BINARY_SEARCH_ORDER 96
+#endif
+
+/* How a set compares its keys. Sets made with `set_init` use their `less`;
+ * the others are made by the typed `_init` functions below.
+ */
+enum set_key_kind {
+    SET_KEY_GENERIC,
+    SET_KEY_I32,
+    SET_KEY_U32,
+    SET_KEY_I64,
+    SET_KEY_U64,
+};
+
+/* Node footprints `set_init_auto` can aim for: each leaf fills at most one,
+ * and starts on a boundary of one, so a search of it touches no other. An
+ * internal node keeps its header and keys in the same first footprint, and
+ * its children after it. The sizes may be overridden to match the host.
+ */
+#ifndef SET_CACHE_LINE
+#define SET_CACHE_LINE 64
+#endif
+#ifndef SET_L2_NODE_BYTES
+#define SET_L2_NODE_BYTES 256
+#endif
+#ifndef SET_PAGE_BYTES
+#define SET_PAGE_BYTES 4096
+#endif
+enum set_node_target {
+    SET_TARGET_LINE, // one L1 cache line, SET_CACHE_LINE bytes
+    SET_TARGET_L2, // SET_L2_NODE_BYTES: a few adjacent lines, which the L2
+                   // prefetchers bring in together once a search touches the
+                   // first
+    SET_TARGET_PAGE, // SET_PAGE_BYTES: one page, so one TLB entry, per leaf
+};
+
+/* Vector instructions the typed integer sets may use to search nodes.
+ */
+enum set_simd {
+    SET_SIMD_NONE,
+    SET_SIMD_SSE2,
+    SET_SIMD_AVX2,
+};
+
+/* Allocator for the nodes of a set. See `set_set_allocator`.
+ *   - `alloc(ctx, size)` returns `size` bytes, suitably aligned for any type.
+ *   - `free(ctx, ptr, size)` releases one block returned by `alloc`. It may
+ *     be NULL if `release` is not.
+ *   - `release(ctx)`, if not NULL, releases every block at once. `set_free`
+ *     then uses it instead of walking the tree to free nodes one by one.
+ */
+typedef struct set_allocator {
+    void *(*alloc)(void *ctx, size_t size);
+    void (*free)(void *ctx, void *ptr, size_t size);
+    void (*release)(void *ctx);
+    void *ctx;
+} set_allocator;
+
+/* Slab arena, usable as a set allocator via `set_arena_allocator`. Nodes are
+ * carved out of large malloc'd chunks, which grow geometrically from the
+ * initial chunk size, and freed nodes are recycled. Releasing the arena costs
+ * one `free` per chunk. An arena must serve only one set at a time.
+ */
+typedef struct set_arena {
+    struct set_arena_chunk *chunks; // newest first
+    char *next; // first unused byte in the newest chunk
+    char *end; // end of the newest chunk
+    size_t chunk_size; // size of the next chunk to allocate
+    size_t min_chunk_size;
+    struct {
+        size_t size;
+        void *head;
+    } free_lists[4]; // recycled blocks, by size
+} set_arena;
+
+/* Latency histogram of one operation, in nanoseconds. Buckets are
+ * log-linear, as in HdrHistogram, each spanning at most 1/8 of the values it
+ * holds; read them with `set_latency_percentile`.
+ */
+#define SET_LATENCY_BUCKETS 496
+typedef struct set_latency {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[SET_LATENCY_BUCKETS];
+} set_latency;
+
+/* Operation counts of one set, kept if compiled with SET_STATS. See
+ * `set_stats`.
+ */
+typedef struct set_stats_t {
+    uint64_t less_calls; // calls of the set's `less` or `cmp`
+    uint64_t node_visits; // nodes searched on the way down the tree
+    uint64_t splits; // nodes split in two (or more, by set_insert_batch)
+    uint64_t allocs; // nodes allocated
+    uint64_t alloc_bytes; // bytes allocated for nodes
+    uint64_t frees; // nodes freed
+    set_latency insert; // of set_insert
+    set_latency contains; // of set_contains
+} set_stats_t;
+
+/* Shape and memory use of a set, as found by `set_inspect`. Fill is the
+ * fraction of a node's key slots in use (`order - 1` per node), and
+ * `fill[i]` counts the nodes whose fill is at least i/10 and below
+ * (i + 1)/10; full nodes count in `fill[9]`.
+ */
+#define SET_REPORT_MAX_LEVELS 64
+typedef struct set_report {
+    size_t height; // levels of nodes; 0 if empty
+    size_t level_nodes[SET_REPORT_MAX_LEVELS]; // nodes on each level, from
+                                               // the root down
+    size_t nodes; // all nodes
+    size_t leaves; // nodes on the last level
+    size_t leaf_fill[10]; // leaves by fill
+    size_t internal_fill[10]; // internal nodes by fill
+    double mean_leaf_fill;
+    double mean_internal_fill;
+    size_t key_bytes; // bytes of the elements themselves
+    size_t alloc_bytes; // bytes allocated for nodes (or the frozen array)
+    size_t leaf_slack_bytes; // bytes of unused key slots in leaves
+    size_t leaf_breaks; // leaves whose successor in order is not at a higher
+                        // address on the same or the next page, so that an
+                        // ordered scan jumps around memory there
+} set_report;
 
 typedef struct set set;
 typedef bool (*set_less_t)(void *, void *);
+typedef int (*set_cmp_t)(const void *, const void *, void *);
+
+/* Set contents. Callers allocate `set`s themselves (statically, on the stack
+ * or on the heap), but should treat the members as private and only use the
+ * functions below.
+ */
+struct set {
+    size_t elem_size;
+    set_less_t less; // NULL if `cmp` is set
+    set_cmp_t cmp; // three-way comparison, or NULL to use `less`
+    void *cmp_ctx; // passed to every call of `cmp`
+    struct set_node *root;
+    uint16_t order; // Knuth order of tree. Equal to max number of children
+    bool binary_search; // search keys within a node by bisection. set_init
+                        // sets this if order > SET_BINARY_SEARCH_ORDER; it
+                        // may be changed at any time
+    uint8_t key_kind; // enum set_key_kind
+    uint8_t simd; // enum set_simd. set_init picks the best the CPU supports;
+                  // it may be lowered at any time, but not raised
+    bool shares_nodes; // may share nodes with a snapshot. See set_snapshot
+    bool is_snapshot; // made by set_snapshot, and so immutable
+    uintptr_t image; // address of the image `s` reads its nodes from, or 0.
+                     // See set_image_open
+    void *frozen; // elements in Eytzinger order while frozen, or NULL. See
+                  // set_freeze
+    set_allocator allocator; // all NULL to use malloc and free
+    size_t node_align; // boundary nodes from malloc start on, or 0 for
+                       // malloc's own alignment. See set_init_auto
+    size_t size; // number of elements
+    // node layout, computed by set_init. Each node is a single allocation
+    // holding its header, then its keys, then (if not a leaf) its children
+    size_t keys_offset; // offset of first key from start of node
+    size_t children_offset; // offset of first child pointer
+    size_t leaf_size; // bytes allocated for a leaf node
+    size_t node_size; // bytes allocated for an internal node
+    size_t counts_offset; // offset of the subtree sizes of the children of
+                          // an internal node; 0 unless tracking ranks
+#ifdef SET_STATS
+    set_stats_t stats; // see set_stats
+#endif
+};
+
+/* Cursor over the elements of a set, in increasing order. Any change to the set
+ * invalidates its cursors.
+ */
+typedef struct set_iter {
+    set *s;
+    struct set_node *leaf; // NULL once past the end
+    size_t index; // of the next element in `leaf`
+} set_iter;
 
 /* Initialize set `s`, containing items of size `elem_size`, and implemented as
- * a B-Tree of Knuth order `order`. `order` shall be 2 or greater.
+ * a B-Tree of Knuth order `order`. `order` shall be 3 or greater.
  * Uses `less` as internal weak-ordered comparison operator.
  * less(x, y) should return true if x < y
  */
-void set_init(set *s, uint8_t order, set_less_t less,
+void set_init(set *s, uint16_t order, set_less_t less,
+        size_t elem_size);
+
+/* Returns the order whose nodes best fill `target` with elements of
+ * `elem_size` bytes: the largest for which a leaf (its header and `order` key
+ * slots, one of them for its upper bound) fits in the target footprint, and
+ * at least 3. Internal nodes are bigger by their child array, and by their
+ * subtree sizes if the set tracks ranks. Elements too big for 3 of them to
+ * fit give 3 regardless. bench/auto_order.c compares the choices on the
+ * host.
+ */
+uint16_t set_auto_order(size_t elem_size, enum set_node_target target);
+
+/* Like `set_init`, with order `set_auto_order(elem_size, target)`, which is
+ * returned. Nodes are then allocated with `aligned_alloc` on boundaries of
+ * the target footprint (if it is a power of 2), rounded up to whole
+ * multiples of it, so that a leaf does not straddle two. Allocators set with
+ * `set_set_allocator` choose their own alignment.
+ */
+uint16_t set_init_auto(set *s, set_less_t less, size_t elem_size,
+        enum set_node_target target);
+
+/* Like `set_init`, but comparing elements with `cmp`, which is passed `ctx`
+ * on every call. cmp(x, y, ctx) should return a negative number if x < y,
+ * zero if they are equivalent, and a positive number if x > y. A search then
+ * costs one call of `cmp` per key it visits, where with `less` it costs an
+ * extra call to tell an equal key from a greater one, which matters for
+ * costly comparisons such as those of strings or of several fields. Images
+ * are opened with a `less` (see `set_image_open`).
+ */
+void set_init_cmp(set *s, uint16_t order, set_cmp_t cmp, void *ctx,
         size_t elem_size);
 
+/* Allocate nodes of `s` with `allocator` instead of malloc and free.
+ * `allocator` is copied. Must be called while `s` is empty.
+ */
+void set_set_allocator(set *s, const set_allocator *allocator);
+
+/* Initialize an empty arena whose first chunk holds `chunk_size` bytes (a
+ * default size is used if 0).
+ */
+void set_arena_init(set_arena *arena, size_t chunk_size);
+
+/* Free every chunk of `arena`, leaving it empty but usable.
+ */
+void set_arena_free(set_arena *arena);
+
+/* Returns an allocator drawing from `arena`, for `set_set_allocator`.
+ * `set_free` on the set then releases the whole arena with `set_arena_free`.
+ */
+set_allocator set_arena_allocator(set_arena *arena);
+
 /* Free the contents of the set `s`. If the set was dynamically allocated, the
  * set itself must still be free'd.
  */
 void set_free(set *s);
 
+/* Returns an immutable snapshot of the current contents of `s`, in O(1). The
+ * snapshot shares its nodes with `s`, which copies a node before it next
+ * changes it if it is still shared, so each later change to `s` copies at
+ * most the O(log n) nodes on its path. Nodes are reference counted, and freed
+ * once neither `s` nor any snapshot uses them. The snapshot is heap-allocated:
+ * release it with `set_free` and then `free`, in any order relative to `s`,
+ * and from any thread.
+ *   - Freeing a snapshot releases the nodes only it still uses, through the
+ *     allocator of `s`. If `s` has one (see `set_set_allocator`) and a
+ *     snapshot may be freed while another thread changes or frees `s` or
+ *     another snapshot of it, the allocator's `alloc` and `free` must be
+ *     safe to call concurrently. `set_arena` is not.
+ *   - A snapshot may be read, from any number of threads, while `s` changes:
+ *     with `set_contains`, `set_contains_batch`, `set_size`, `set_map` and
+ *     `set_map_parallel` (whose `func` must then not change elements), and
+ *     `set_select` and `set_rank` if `s` tracks ranks. Snapshots do not keep
+ *     the leaf chain, so cursors and the functions built on them do not work
+ *     on snapshots.
+ *   - `set_map` and `set_map_parallel` on `s` first copy every node still
+ *     shared, so their `func` may change elements as usual. Elements of `s`
+ *     reached through a cursor must not be changed while snapshots exist.
+ *   - Snapshots may not be taken of sets using `set_insert_shared`, of
+ *     images (see `set_image_open`), of frozen sets (see `set_freeze`), or
+ *     of sets whose allocator has a `release` function; NULL is returned for
+ *     the latter three, and if the snapshot cannot be allocated.
+ *   - If a node shared with a snapshot cannot be copied for lack of memory,
+ *     the change to `s` which needed the copy is not made: `set_insert`
+ *     inserts nothing, `set_erase` and `set_insert_batch` return false, and
+ *     `set_map` and `set_map_parallel` do not call `func`. An erase whose
+ *     rebalancing cannot copy a sibling leaves the node short of keys, which
+ *     is harmless.
+ */
+set *set_snapshot(set *s);
+
 /* See if `s` contains an element equivalent to `elem`. If so, `set_contains`
  * returns true; if not it returns false. If `copy_out` is not NULL, and an
  * element equivalent to `elem` is found, the contained element is copied to
@@ -26,14 +289,318 @@ void set_free(set *s);
  */
 bool set_contains(set *s, void *elem, void *copy_out);
 
-/* Insert `elem` into set `s`.
+/* Like `set_contains`, but safe to call from any number of threads while
+ * either one other thread changes `s` with `set_insert` or `set_insert_batch`,
+ * or any number call `set_insert_shared`. Readers take no locks and never
+ * block writers: each node records a version, which writers bump around every
+ * change, and a reader retries its descent if a node it read changed
+ * meanwhile, which is rare unless a writer is changing the node at that
+ * moment. `less` may be called on an element while it is being
+ * overwritten, and must not crash if so (its result is discarded); comparing
+ * plain values is fine, following pointers stored in elements is not. Other
+ * changes to `s`, such as `set_erase`, must not overlap with readers.
+ */
+bool set_contains_shared(set *s, void *elem, void *copy_out);
+
+/* Remove the element equivalent to `elem` from `s`. If there was one,
+ * `set_erase` returns true, and copies the removed element to `copy_out` if
+ * that is not NULL; if not it returns false. Nodes left underfull borrow from
+ * or merge with a sibling, so every node stays at least half full and lookups
+ * stay O(log n) under any mix of inserts and erases.
+ */
+bool set_erase(set *s, const void *elem, void *copy_out);
+
+/* Returns the number of elements in `s`, in O(1).
+ */
+size_t set_size(set *s);
+
+/* Make `s` keep the size of every subtree in its internal nodes, so that
+ * `set_select` and `set_rank` take O(log n) rather than O(n). This costs
+ * `order` words per internal node, and inserts and erases update the sizes on
+ * their path. Must be called while `s` is empty.
+ */
+void set_track_ranks(set *s);
+
+/* Copy the `k`th smallest element of `s` (counting from 0) to `out` and return
+ * true, or return false if `s` has `k` or fewer elements.
+ */
+bool set_select(set *s, size_t k, void *out);
+
+/* Returns the number of elements of `s` less than `elem`, which is the index
+ * `set_select` would find `elem` at if `s` contains it.
+ */
+size_t set_rank(set *s, const void *elem);
+
+/* Like `set_insert`, but safe to call from any number of threads at once, and
+ * alongside `set_contains_shared`. Writers lock only the nodes they change,
+ * one level at a time from the leaf up. A split links the new right node as
+ * the `right_sibling` of the old one before unlocking it, and every node keeps
+ * the upper bound of its keys, so descents which reach the old node before
+ * its parent is updated step right instead of blocking (a Lehman-Yao B-link
+ * tree). The same limits as for `set_contains_shared` apply to `less` and to
+ * other changes; in addition, `s` must not track ranks, and its allocator
+ * must be thread-safe (malloc is, a `set_arena` is not). Returns false,
+ * leaving `s` unchanged, if `elem` would split a node and the copy of the
+ * separator this needs cannot be allocated, or if `s` is empty and its first
+ * leaf cannot be; true otherwise.
+ */
+bool set_insert_shared(set *s, void *elem);
+
+/* Look up the `n` elements at `keys` in `s`, like calling `set_contains` on
+ * each: `out[i]` is set to whether `s` contains an element equivalent to key
+ * `i`, and if it does and `copy_out` is not NULL, that element is copied to
+ * element `i` of the array at `copy_out`. Returns the number of keys found.
+ * Groups of keys descend the tree together, prefetching the nodes each will
+ * visit next, so that their cache misses overlap.
+ */
+size_t set_contains_batch(set *s, const void *keys, size_t n, bool *out,
+        void *copy_out);
+
+/* Insert `elem` into set `s`. If `s` already contains an element equivalent to
+ * `elem`, `s` is left unchanged.
  */
 void set_insert(set *s, void *elem);
 
-/* Apply function `func` to every element in `s`. `func`'s first argument must
-   be the item stored in a set. `func` must not modify items in the set in a
-   way which alters their relative ordering. `extra` should contain any
-   extra information that `func` needs, and is passed as the second argument to
-   `func`.
+/* Insert the `n` elements at `elems` into `s`, like calling `set_insert` on
+ * each, but faster for large batches. `elems` is reordered: it is sorted and
+ * de-duplicated in place, then merged into the tree leaf by leaf. The tree is
+ * descended once per leaf touched rather than once per element, and each leaf
+ * is split at most once. Returns false if the sorting buffer or the leaves a
+ * split needs cannot be allocated, or a node shared with a snapshot cannot
+ * be copied. `s` is then unchanged if it was the buffer, and otherwise holds
+ * the elements merged into the leaves before the one that failed.
+ */
+bool set_insert_batch(set *s, void *elems, size_t n);
+
+/* Replace the contents of `s` with the `n` elements at `elems`, which must be
+ * sorted in increasing order with no two equivalent. The tree is built
+ * bottom-up in O(n), with each node filled to about `fill` of its capacity
+ * (0 < fill <= 1), but never below the minimum fill of a B-Tree node. A fill
+ * below 1 leaves room for later inserts without splitting.
+ */
+void set_build_sorted(set *s, const void *elems, size_t n, double fill);
+
+/* Position `it` at the smallest element of `s`.
+ */
+void set_iter_begin(set *s, set_iter *it);
+
+/* Position `it` at the smallest element of `s` which is not less than `elem`.
+ */
+void set_iter_seek(set *s, set_iter *it, const void *elem);
+
+/* Returns the element at `it` and advances `it` to the next element, or returns
+ * NULL if `it` is past the largest element. The element must not be modified
+ * in a way which alters its ordering. Each step is O(1) amortized: it follows
+ * the chain of leaves, with no recursion or callbacks.
+ */
+void *set_iter_next(set_iter *it);
+
+/* Find the smallest element of `s` which is not less than `elem`. If there is
+ * one, `set_lower_bound` returns true, and copies it to `copy_out` if that is
+ * not NULL; if not it returns false.
+ */
+bool set_lower_bound(set *s, const void *elem, void *copy_out);
+
+/* Like `set_lower_bound`, but finds the smallest element greater than `elem`.
+ */
+bool set_upper_bound(set *s, const void *elem, void *copy_out);
+
+/* Apply `func` to every element of `s` which is not less than `low` and less
+ * than `high`, in increasing order, and return how many there were. A NULL
+ * `low` or `high` leaves that end of the range open. `func` and `extra` are
+ * as for `set_map`. Costs one descent plus a scan of the leaves in the range:
+ * O(log n + k) for k elements visited.
+ */
+size_t set_range(set *s, const void *low, const void *high,
+        void (*func)(void *, void *), void *extra);
+
+/* Set algebra. Each replaces the contents of `dst` with the elements of `a`
+ * and `b` described below, and returns how many there are. `dst` must have
+ * been initialized with the same element size and ordering as `a` and `b`
+ * (its order and allocator may differ), and may be `a` or `b` itself. The
+ * leaves of `a` and `b` are merged in a single ordered pass and `dst` is
+ * built bottom-up from the result, with full nodes, so each costs O(n + m)
+ * time and O(n + m) temporary memory, for sets of n and m elements. Where an
+ * element is in both sets, `a`'s copy is kept. `a` and `b` may not be
+ * snapshots. If memory runs out, SIZE_MAX is returned: `dst` is untouched if
+ * the temporary memory could not be allocated, and left empty if its nodes
+ * could not be.
+ */
+
+/* Elements in `a`, `b` or both.
+ */
+size_t set_union(set *dst, set *a, set *b);
+
+/* Elements in both `a` and `b`.
+ */
+size_t set_intersect(set *dst, set *a, set *b);
+
+/* Elements in `a` but not `b`.
+ */
+size_t set_difference(set *dst, set *a, set *b);
+
+/* Elements in exactly one of `a` and `b`.
+ */
+size_t set_symdiff(set *dst, set *a, set *b);
+
+/* Apply function `func` to every element in `s`, in increasing order. `func`'s
+   first argument must be the item stored in a set. `func` must not modify
+   items in the set in a way which alters their relative ordering. `extra`
+   should contain any extra information that `func` needs, and is passed as the
+   second argument to `func`.
  */
 void set_map(set *s, void (*func)(void *, void *), void *extra);
+
+/* Like `set_map`, but spread over `n_threads` threads (the calling thread and
+ * `n_threads - 1` new ones), and in no particular order. The tree is cut into
+ * about 8 subtrees per thread, taken from one level so they are of similar
+ * size, and each thread starts on a contiguous run of them. A thread which
+ * runs out steals half of the remaining subtrees of another, so uneven
+ * subtrees or `func` costs still balance. Thread `i` passes `extra[i]` to
+ * `func` (or NULL if `extra` is NULL), so per-thread state needs no locking;
+ * `func` must be safe to call on different elements concurrently. `s` must
+ * not change during the call. If the bookkeeping for the threads cannot be
+ * allocated, every element is mapped on the calling thread, with `extra[0]`.
+ * Requires linking with -pthread.
+ */
+void set_map_parallel(set *s, void (*func)(void *, void *), void **extra,
+        size_t n_threads);
+
+/* Images: a set stored as a file which can be mapped into memory and queried
+ * in place, with no loading step. An image holds the nodes of the tree in
+ * their usual layout, except that nodes refer to each other by offsets from
+ * the start of the image instead of pointers. Nodes are stored level by level
+ * from the root, and packed so that none straddles a 4 KiB page, so a lookup
+ * in a freshly mapped image reads one page per level, and the upper levels
+ * share their first few pages. Images can only be read on hosts with the same
+ * byte order and pointer size as the one which wrote them.
+ */
+
+/* Write an image of `s` to `out`, and return whether that succeeded. `out`
+ * should be at its start (or a page boundary), so the image can be mapped. `s`
+ * may be a snapshot, so a set can be saved by one thread while another
+ * changes it.
+ */
+bool set_image_write(set *s, FILE *out);
+
+/* Initialize `s` to read the image of `size` bytes at `image`, which is
+ * usually a read-only `mmap` of a file written by `set_image_write`, and
+ * return true; or return false if `image` is not a complete image. This is
+ * O(1): nodes are read straight from `image` when needed, so only the header
+ * and the position of the root are checked, and the other nodes are trusted.
+ * `less` must order elements as the set which was written did; it is ignored
+ * for images of the typed sets (see `SET_DECLARE_TYPED`), which get their
+ * own. `image` must be aligned as malloc would align it, and stay mapped
+ * until `s` is freed or promoted.
+ *   - Until promoted, `s` is read-only. It can be read with `set_contains`,
+ *     `set_contains_batch`, `set_size`, `set_select`, `set_rank`, cursors and
+ *     the functions built on them, and, with a `func` which does not change
+ *     elements, `set_map` and `set_map_parallel`. It may also be one of the
+ *     sets read by the set algebra functions, or written as an image.
+ *   - `set_free` forgets `image` without unmapping it.
+ */
+bool set_image_open(set *s, const void *image, size_t size, set_less_t less);
+
+/* Copy every node of `s`, which was initialized with `set_image_open`, out of
+ * its image, making `s` an ordinary set. The tree keeps its shape, so this is
+ * O(n) copying with no comparisons. The image may be unmapped afterwards.
+ */
+void set_image_promote(set *s);
+
+/* Write the elements of `s` to `out`, in increasing order, and return whether
+ * that succeeded. Leaves are encoded as they are walked, a chunk of up to
+ * 4096 elements at a time, so no copy of the set is made. Elements of the
+ * typed sets are stored as varint differences between neighbours, so sets of
+ * nearby integers take a byte or two per element, in a format which does not
+ * depend on the host; those of other sets are stored as they are in memory.
+ * `s` may be a snapshot or an image, and `out` may be a pipe.
+ */
+bool set_write(set *s, FILE *out);
+
+/* Replace the contents of `s` with the elements written to `in` by
+ * `set_write`, and return true; or return false, leaving `s` empty, if `in`
+ * does not hold such a stream, it was written by a set with a different
+ * element size or key kind, or memory runs out. The tree is built bottom-up as by
+ * `set_build_sorted` (with full nodes) while `in` is read, in O(n) and with
+ * no comparisons but the checks that the elements are in order.
+ */
+bool set_read(set *s, FILE *in);
+
+/* Replace the tree of `s` by a single array of its elements in Eytzinger
+ * order (the breadth-first order of a complete binary search tree), for long
+ * phases with no changes. `set_contains` on the frozen set finds the same
+ * elements, but its search is branch-free, reads one cache line per level
+ * with the lower levels prefetched ahead of time, and needs no pointers, so
+ * the set takes about `elem_size` bytes per element. Costs O(n). Returns
+ * false, leaving the tree as it was, if the array cannot be allocated.
+ *   - Until thawed, `s` can only be read with `set_contains`,
+ *     `set_contains_batch`, `set_size` and `set_map`, and freed.
+ *   - `s` may not be a snapshot, or have snapshots.
+ */
+bool set_freeze(set *s);
+
+/* Turn frozen set `s` back into a tree, built bottom-up with full nodes as by
+ * `set_build_sorted`, in O(n). Returns false, leaving `s` frozen, if the nodes
+ * cannot be allocated.
+ */
+bool set_thaw(set *s);
+
+/* Walk the nodes of `s` and describe them in `out`. Costs one visit to each
+ * node, which reads its header and, in internal nodes, its child array, but
+ * never its keys. Leaves cost about one cache miss each (a fraction 1/order
+ * of the elements, or less), and internal nodes, which are about 1/order of
+ * the nodes, a few more for their children. Like other reads, it must not
+ * overlap with changes to `s`; to watch a set from another thread, inspect a
+ * snapshot of it. Works on snapshots, images and frozen sets too; a frozen
+ * set reports no nodes.
+ */
+void set_inspect(set *s, set_report *out);
+
+/* Instrumentation. If set.c and everything including set.h are compiled with
+ * SET_STATS defined, each set counts calls of `less`, node visits, splits and
+ * node allocations, and keeps latency histograms of `set_insert` and
+ * `set_contains` (which then read the clock twice per call). Otherwise
+ * nothing is counted, at no cost. Counts are not atomic: while several
+ * threads use a set, some increments may be lost.
+ */
+
+/* Copy the counts of `s` since it was initialized or last reset to `out`,
+ * and return true; or, if not compiled with SET_STATS, zero `out` and return
+ * false.
+ */
+bool set_stats(set *s, set_stats_t *out);
+
+/* Reset the counts of `s` to zero.
+ */
+void set_stats_reset(set *s);
+
+/* Returns an upper bound on the latency, in nanoseconds, below which
+ * `percentile` percent of the operations recorded in `latency` fell, good to
+ * within 1/8, or 0 if none were recorded.
+ */
+uint64_t set_latency_percentile(const set_latency *latency,
+        double percentile);
+
+/* Sets of native integers, declared by `SET_DECLARE_TYPED` for each `name`
+ * and `type` below. These are ordinary `set`s with the same B-Tree semantics:
+ * free them with `set_free`, and use any generic function on them. The only
+ * difference is that keys are compared with the built-in `<` on `type` instead
+ * of through a `set_less_t`, so the search within each node is inlined and
+ * can be vectorized. This also speeds up generic calls such as `set_contains`.
+ *   - `name_init(s, order)` replaces `set_init`, and
+ *     `name_init_auto(s, target)` replaces `set_init_auto`.
+ *   - `name_contains` and `name_insert` take elements by value, and otherwise
+ *     behave like `set_contains` and `set_insert`.
+ *   - `name_less` is the `set_less_t` these sets report as their `less`.
+ */
+#define SET_DECLARE_TYPED(name, type)                                         \
+    void name##_init(set *s, uint16_t order);                                 \
+    uint16_t name##_init_auto(set *s, enum set_node_target target);           \
+    bool name##_contains(set *s, type elem, type *copy_out);                  \
+    void name##_insert(set *s, type elem);                                    \
+    bool name##_less(void *x, void *y);
+
+SET_DECLARE_TYPED(set_i32, int32_t)
+SET_DECLARE_TYPED(set_u32, uint32_t)
+SET_DECLARE_TYPED(set_i64, int64_t)
+SET_DECLARE_TYPED(set_u64, uint64_t)